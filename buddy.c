@@ -0,0 +1,342 @@
+/*
+ * buddy.c
+ *
+ * A binary buddy engine, an alternative to the free list engine of mm.c
+ * which hands every call here once it is selected with mm_set_engine.
+ * Blocks are powers of two from 32 bytes up and sit at offsets from the heap base
+ * that are multiples of their size, so the buddy of a block is found by flipping
+ * the bit of its order in the offset. Free blocks are kept on one list per order
+ * and a bitmap marks the orders that have any. Splitting and merging only ever
+ * touch one block per order, so both are bounded by the number of orders
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "memlib.h"
+#include "buddy.h"
+
+/*
+ * If you want to enable your debugging output and heap checker code,
+ * uncomment the following line. Be sure not to have debugging enabled
+ * in your final submission.
+ */
+//  #define DEBUG
+
+#ifdef DEBUG
+/* When debugging is enabled, the underlying functions get called */
+#define dbg_printf(...) printf(__VA_ARGS__)
+#define dbg_assert(...) assert(__VA_ARGS__)
+#else
+/* When debugging is disabled, no code gets generated */
+#define dbg_printf(...)
+#define dbg_assert(...)
+#endif /* DEBUG */
+
+#ifdef DRIVER
+/* create aliases for driver tests */
+#define memcpy mem_memcpy
+#endif /* DRIVER */
+
+// Smallest block holds a header and the two free list links, the offsets of the
+// largest possible heap fit in the orders below ORDER_COUNT
+#define MIN_ORDER 5
+#define ORDER_COUNT 64
+
+// Size of a block header, which holds the order of the block and its allocation bit
+size_t BUDDY_HEAD_SIZE = 8;
+
+// Address of the block at offset 0, one header before a 16 byte boundary so every
+// payload is aligned, and the offset of the end of the heap
+static char *buddy_base;
+static size_t buddy_end;
+
+// Heads of the free lists of each order and the bitmap of non-empty orders
+static char *order_lists[ORDER_COUNT];
+static uint64_t order_bitmap;
+
+// Returns the order of the block at given address
+static int ORDER(char *block) {return (int)(*(uint64_t *)block >> 1);}
+
+// Returns allocation status of the block at given address
+static bool IS_ALLOC(char *block) {return (*(uint64_t *)block & 0x1);}
+
+// Writes the header of the block at given address
+static void PUT_HEADER(char *block, int order, bool alloc) {*(uint64_t *)block = ((uint64_t)order << 1) | alloc;}
+
+// Return and write the free list links stored after the header of a free block
+static char *GET_PREV_BLOCK(char *block) {return *(char **)(block + BUDDY_HEAD_SIZE);}
+static char *GET_NEXT_BLOCK(char *block) {return *(char **)(block + 2*BUDDY_HEAD_SIZE);}
+static void PUT_PREV_BLOCK(char *block, char *prev) {*(char **)(block + BUDDY_HEAD_SIZE) = prev;}
+static void PUT_NEXT_BLOCK(char *block, char *next) {*(char **)(block + 2*BUDDY_HEAD_SIZE) = next;}
+
+// Returns the size of a block of given order
+static size_t ORDER_SIZE(int order) {return (size_t)1 << order;}
+
+// Returns the offset of the block at given address from the heap base
+static size_t OFFSET(char *block) {return (size_t)(block - buddy_base);}
+
+// Returns the offset of the buddy of the block at given offset and order
+static size_t BUDDY(size_t offset, int order) {return offset ^ ORDER_SIZE(order);}
+
+// Returns the smallest order whose blocks hold the given payload and a header
+static int REQUEST_ORDER(size_t size)
+{
+    size_t need = size + BUDDY_HEAD_SIZE;
+    int order = 64 - __builtin_clzll(need - 1);
+    return (order < MIN_ORDER) ? MIN_ORDER : order;
+}
+
+// Pushes a free block at the head of the list of its order
+static void list_push(char *block, int order)
+{
+    char *head = order_lists[order];
+
+    PUT_HEADER(block, order, false);
+    PUT_PREV_BLOCK(block, NULL);
+    PUT_NEXT_BLOCK(block, head);
+    if (head != NULL) PUT_PREV_BLOCK(head, block);
+
+    order_lists[order] = block;
+    order_bitmap |= (1ULL << order);
+}
+
+// Unlinks a free block from the list of its order
+static void list_remove(char *block, int order)
+{
+    char *prev = GET_PREV_BLOCK(block), *next = GET_NEXT_BLOCK(block);
+
+    if (next != NULL) PUT_PREV_BLOCK(next, prev);
+    if (prev != NULL) PUT_NEXT_BLOCK(prev, next);
+    else order_lists[order] = next;
+
+    if (order_lists[order] == NULL) order_bitmap &= ~(1ULL << order);
+}
+
+// Frees a block, merging it with its buddy for as long as the buddy is a whole free block
+// of the same order, and puts the result on the free list of its order
+static void release(char *block, int order)
+{
+    for (; order < ORDER_COUNT - 1; order++) {
+        size_t buddy = BUDDY(OFFSET(block), order);
+
+        // A buddy past the end of the heap doesn't exist yet
+        if (buddy + ORDER_SIZE(order) > buddy_end) break;
+        if (IS_ALLOC(buddy_base + buddy) || ORDER(buddy_base + buddy) != order) break;
+
+        list_remove(buddy_base + buddy, order);
+        if (buddy < OFFSET(block)) block = buddy_base + buddy;
+    }
+    list_push(block, order);
+}
+
+// Grows the heap by a block of given order and returns it. The end of the heap is first
+// brought to a multiple of the block size with smaller blocks that go on the free lists.
+// The break moves once for the padding and the block, so only one batch past the old
+// break is prefaulted and the padding costs no more than the headers written into it
+static char *extend(int order)
+{
+    size_t end = (buddy_end + ORDER_SIZE(order) - 1) & ~(ORDER_SIZE(order) - 1);
+    char *pad;
+
+    if ((long)(pad = mem_sbrk(end + ORDER_SIZE(order) - buddy_end)) == -1) return NULL;
+
+    while (buddy_end < end) {
+        int order_pad = __builtin_ctzll(buddy_end);
+
+        buddy_end += ORDER_SIZE(order_pad);
+        release(pad, order_pad);
+        pad += ORDER_SIZE(order_pad);
+    }
+
+    buddy_end += ORDER_SIZE(order);
+    return buddy_base + end;
+}
+
+// Grows an allocated block to the given order without moving it. Every buddy on the way
+// must be a free upper buddy, or lie past the end of the heap which then grows to fit
+static bool grow_in_place(char *block, int order, int need)
+{
+    size_t offset = OFFSET(block);
+    int reach = order;
+
+    for (; reach < need; reach++) {
+        size_t buddy = offset + ORDER_SIZE(reach);
+
+        if (offset & ORDER_SIZE(reach)) return false;
+        if (buddy == buddy_end) break;
+        if (IS_ALLOC(buddy_base + buddy) || ORDER(buddy_base + buddy) != reach) return false;
+    }
+
+    // The block is last in the heap, what it is missing is requested at once
+    if (reach < need) {
+        if (offset % ORDER_SIZE(need) != 0) return false;
+        if ((long)mem_sbrk(offset + ORDER_SIZE(need) - buddy_end) == -1) return false;
+        buddy_end = offset + ORDER_SIZE(need);
+    }
+
+    for (int absorbed = order; absorbed < reach; absorbed++) list_remove(block + ORDER_SIZE(absorbed), absorbed);
+    PUT_HEADER(block, need, true);
+    return true;
+}
+
+/*
+ * buddy_init - starts an empty heap, returns false on error
+ */
+bool buddy_init(void)
+{
+    char *pad;
+
+    if ((pad = mem_sbrk(BUDDY_HEAD_SIZE)) == (void *)-1) return false;
+
+    buddy_base = pad + BUDDY_HEAD_SIZE;
+    buddy_end = 0;
+    order_bitmap = 0;
+    for (int order = 0; order < ORDER_COUNT; order++) order_lists[order] = NULL;
+
+    return true;
+}
+
+/*
+ * buddy_malloc - takes the smallest free block of a large enough order and splits
+ * it down, the upper halves go on the free lists. The heap grows if there is none
+ */
+void *buddy_malloc(size_t size)
+{
+    char *block;
+
+    if (size == 0) return NULL;
+
+    int order = REQUEST_ORDER(size);
+    uint64_t orders = order_bitmap & (~0ULL << order);
+
+    if (orders == 0) {
+        if ((block = extend(order)) == NULL) return NULL;
+    }
+    else {
+        int found = __builtin_ctzll(orders);
+        block = order_lists[found];
+        list_remove(block, found);
+
+        while (found > order) {
+            found -= 1;
+            list_push(block + ORDER_SIZE(found), found);
+        }
+    }
+
+    PUT_HEADER(block, order, true);
+
+    dbg_printf("\nBUDDY MALLOC OF SIZE %lx ORDER %d AT OFFSET %lx\n", (uint64_t)size, order, OFFSET(block));
+    if (!buddy_checkheap(__LINE__)) return NULL;
+
+    return block + BUDDY_HEAD_SIZE;
+}
+
+/*
+ * buddy_free - frees a block and merges it with its free buddies
+ */
+void buddy_free(void *ptr)
+{
+    if (ptr == NULL) return;
+
+    char *block = (char *)ptr - BUDDY_HEAD_SIZE;
+
+    dbg_printf("\nBUDDY FREE AT OFFSET %lx\n", OFFSET(block));
+    release(block, ORDER(block));
+
+    if (!buddy_checkheap(__LINE__)) exit(0);
+}
+
+/*
+ * buddy_realloc - shrinking gives the upper halves of the block back, growing
+ * absorbs free upper buddies when it can and copies to a new block otherwise
+ */
+void *buddy_realloc(void *ptr, size_t size)
+{
+    if (size == 0) {
+        buddy_free(ptr);
+        return NULL;
+    }
+    if (ptr == NULL) return buddy_malloc(size);
+
+    char *block = (char *)ptr - BUDDY_HEAD_SIZE;
+    int order = ORDER(block), need = REQUEST_ORDER(size);
+
+    // The lower half keeps the payload, so the upper halves can never merge with it
+    if (need <= order) {
+        while (order > need) {
+            order -= 1;
+            list_push(block + ORDER_SIZE(order), order);
+        }
+        PUT_HEADER(block, order, true);
+        return ptr;
+    }
+
+    if (grow_in_place(block, order, need)) return ptr;
+
+    void *new_ptr = buddy_malloc(size);
+    if (new_ptr == NULL) return NULL;
+    memcpy(new_ptr, ptr, ORDER_SIZE(order) - BUDDY_HEAD_SIZE);
+    buddy_free(ptr);
+    return new_ptr;
+}
+
+/*
+ * buddy_checkheap - every block must be aligned to its size and inside the heap,
+ * no free block may have a free buddy of its order, and the free lists and their
+ * bitmap must hold exactly the free blocks
+ */
+bool buddy_checkheap(int lineno)
+{
+    #ifdef DEBUG
+
+        int count = 0;
+
+        for (size_t offset = 0; offset < buddy_end; offset += ORDER_SIZE(ORDER(buddy_base + offset))) {
+            char *block = buddy_base + offset;
+            int order = ORDER(block);
+            size_t buddy = BUDDY(offset, order);
+
+            if (order < MIN_ORDER || order >= ORDER_COUNT || offset % ORDER_SIZE(order) != 0 || offset + ORDER_SIZE(order) > buddy_end) {
+                dbg_printf("\nERROR AT LINE %d: ", lineno);
+                dbg_printf("Block at offset %lx of order %d is misplaced\n", offset, order);
+                return false;
+            }
+            if (!IS_ALLOC(block) && buddy + ORDER_SIZE(order) <= buddy_end && !IS_ALLOC(buddy_base + buddy) && ORDER(buddy_base + buddy) == order) {
+                dbg_printf("\nERROR AT LINE %d: ", lineno);
+                dbg_printf("Free block at offset %lx and its buddy weren't merged\n", offset);
+                return false;
+            }
+            if (!IS_ALLOC(block)) count += 1;
+        }
+
+        for (int order = 0; order < ORDER_COUNT; order++) {
+            if ((order_lists[order] != NULL) != (((order_bitmap >> order) & 1) == 1)) {
+                dbg_printf("\nERROR AT LINE %d: ", lineno);
+                dbg_printf("Bitmap doesn't match the free list of order %d\n", order);
+                return false;
+            }
+
+            for (char *block = order_lists[order]; block != NULL; block = GET_NEXT_BLOCK(block)) {
+                if (IS_ALLOC(block) || ORDER(block) != order || (GET_NEXT_BLOCK(block) != NULL && GET_PREV_BLOCK(GET_NEXT_BLOCK(block)) != block)) {
+                    dbg_printf("\nERROR AT LINE %d: ", lineno);
+                    dbg_printf("Block at offset %lx doesn't belong in the free list of order %d\n", OFFSET(block), order);
+                    return false;
+                }
+                count -= 1;
+            }
+        }
+
+        if (count != 0) {
+            dbg_printf("\nERROR AT LINE %d: ", lineno);
+            dbg_printf("Free lists and free blocks differ by %d\n", count);
+            return false;
+        }
+
+    #endif
+
+    return true;
+}
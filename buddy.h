@@ -0,0 +1,14 @@
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Binary buddy engine. mm.c hands every call to these when the buddy engine
+ * is selected, see mm_set_engine.
+ */
+extern bool buddy_init(void);
+extern void *buddy_malloc(size_t size);
+extern void buddy_free(void *ptr);
+extern void *buddy_realloc(void *ptr, size_t size);
+
+/* This is for debugging.  Returns false if error encountered */
+extern bool buddy_checkheap(int lineno);
@@ -103,6 +103,12 @@
  */
 #define MAX_HEAP_SIZE (1ull*(1ull<<40)) /* 1 TB */
 
+/*
+ * Bytes past the break that mem_sbrk faults in ahead of time whenever the
+ * break passes the prefaulted part of the heap, 0 to fault on first touch
+ */
+#define PREFAULT_BATCH (1ull<<18) /* 256 KB */
+
 
 /***************** Parameters for looking up reference throughput *********/
 /*
@@ -0,0 +1,70 @@
+/*
+ * growth.c
+ *
+ * The heap growth policy of mm.c. The heap only ever grows by what it is short of,
+ * the free block at its end already counts, but never by less than a chunk. The chunk
+ * follows the allocation rate: it starts small so a heap that stops growing early wastes
+ * little, doubles whenever the heap falls short again within a few requests, and halves
+ * again once a long stretch of requests went by without it falling short
+ */
+#include <stdbool.h>
+
+#include "growth.h"
+
+// Chunk bounds, both powers of two so a chunk stays a multiple of the alignment
+size_t GROWTH_MIN_CHUNK = (1 << 10);
+size_t GROWTH_MAX_CHUNK = (1 << 16);
+
+// The heap falling short again within GROWTH_BURST requests is sustained demand,
+// GROWTH_QUIET times as many requests without it falling short is not
+long GROWTH_BURST = 4;
+long GROWTH_QUIET = 2;
+
+/*
+ * growth_reset - forgets every decision, the next chunk is the smallest
+ */
+void growth_reset(growth_policy_t *policy)
+{
+    policy->chunk = GROWTH_MIN_CHUNK;
+    policy->requests = 0;
+    policy->last_grow = 0;
+    policy->grows = 0;
+    policy->grown = 0;
+    policy->needed = 0;
+    policy->max_chunk = GROWTH_MIN_CHUNK;
+}
+
+// Returns the chunk adapted to the requests seen since the heap last grew
+static size_t growth_chunk(const growth_policy_t *policy)
+{
+    long since = policy->requests - policy->last_grow;
+
+    if (policy->grows == 0) return policy->chunk;
+    if (since <= GROWTH_BURST && policy->chunk < GROWTH_MAX_CHUNK) return policy->chunk * 2;
+    if (since > GROWTH_BURST * GROWTH_QUIET && policy->chunk > GROWTH_MIN_CHUNK) return policy->chunk / 2;
+    return policy->chunk;
+}
+
+/*
+ * growth_extension - returns how far the heap grows when it is shortfall bytes short,
+ * nothing is decided until growth_record
+ */
+size_t growth_extension(const growth_policy_t *policy, size_t shortfall)
+{
+    size_t chunk = growth_chunk(policy);
+    return (shortfall > chunk) ? shortfall : chunk;
+}
+
+/*
+ * growth_record - records that the heap grew by size bytes when it was shortfall bytes
+ * short, the chunk adapts only now
+ */
+void growth_record(growth_policy_t *policy, size_t shortfall, size_t size)
+{
+    policy->chunk = growth_chunk(policy);
+    policy->last_grow = policy->requests;
+    policy->grows += 1;
+    policy->grown += size;
+    policy->needed += shortfall;
+    if (policy->chunk > policy->max_chunk) policy->max_chunk = policy->chunk;
+}
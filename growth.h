@@ -0,0 +1,23 @@
+#include <stddef.h>
+
+/*
+ * Heap growth policy of mm.c, one per context. mm.c counts the requests it
+ * sees and asks the policy how far to grow whenever the heap falls short.
+ */
+typedef struct growth_policy {
+    size_t chunk;      /* Least the heap grows by next time */
+    long requests;     /* Requests seen so far, counted by mm.c */
+    long last_grow;    /* Requests seen when the heap last grew */
+    long grows;        /* Times the heap grew */
+    size_t grown;      /* Bytes it grew by */
+    size_t needed;     /* Bytes it was short of when it grew */
+    size_t max_chunk;  /* Largest chunk it reached */
+} growth_policy_t;
+
+extern void growth_reset(growth_policy_t *policy);
+
+/* Returns how many bytes to grow the heap by when it is shortfall bytes short */
+extern size_t growth_extension(const growth_policy_t *policy, size_t shortfall);
+
+/* Records that the heap grew by size bytes, only once it actually did */
+extern void growth_record(growth_policy_t *policy, size_t shortfall, size_t size);
@@ -20,6 +20,13 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <math.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -40,6 +47,13 @@
 #define REF_ONLY 0
 #endif
 
+/* Thread scaling benchmark of -P */
+#define THREAD_OPS  1000000       /* malloc and free calls of each thread */
+#define THREAD_SLOTS    256       /* blocks each thread keeps at once */
+#define THREAD_SIZE     512       /* largest request size */
+#define THREAD_SAMPLE    16       /* one free in this many is timed */
+#define HANDOFF_OPS  200000       /* blocks the producer of -P hands to the consumer */
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
@@ -121,6 +135,8 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;       /* space utilization for this trace (always 0 for libc) */
+    mm_growth_stats_t growth; /* heap growth decisions while measuring util */
+    long long misses;  /* cache misses of one timed run, -1 if they could not be counted */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -160,6 +176,8 @@ int verbose = REF_ONLY ? 0 : 1;  /* global flag for verbose output */
 static int errors = 0;           /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false;     /* Print output as tab-separated fields */
+static bool count_misses = false; /* Count the cache misses of each trace (set by -M) */
+static int misses_errno = 0;      /* Why the cache misses could not be counted */
 static size_t maxfill = MAXFILL;
 
 /* by default, no timeouts */
@@ -217,11 +235,16 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
+static bool eval_mm_contexts(trace_t *trace);
 static double eval_mm_util(trace_t *trace, int tracenum);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_threads(int max_threads, bool background, int arenas);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void printgrowth(int n, stats_t *stats);
+static long long eval_mm_misses(speed_t *speed_params);
+static void printmisses(int n, stats_t *stats);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -284,11 +307,16 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             if (verbose > 1)
                 printf("efficiency, ");
             mm_stats[i].util = eval_mm_util(trace, i);
+            mm_growth_stats(&mm_stats[i].growth);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs = fsec(eval_mm_speed, speed_params);
+            if (count_misses)
+                mm_stats[i].misses = eval_mm_misses(speed_params);
+            if (verbose > 1)
+                printf("Prefaulted %zu bytes ahead of the break.\n", mem_prefaulted());
         }
 
 #if 0
@@ -329,6 +357,12 @@ int main(int argc, char **argv)
     speed_t speed_params;      /* input parameters to the xx_speed routines */
 
     bool run_libc = false;     /* If set, run libc malloc (set by -l) */
+    bool run_huge = false;     /* If set, run mm malloc on huge pages as well (set by -H) */
+    int run_threads = 0;       /* If set, measure mm malloc in up to this many threads (set by -P) */
+    bool run_background = false; /* If set, hand the frees of -P to the background thread (set by -B) */
+    int run_arenas = 0;        /* If set, force this many arenas for -P (set by -A) */
+    bool show_growth = false;  /* If set, print the heap growth decisions of each trace (set by -g) */
+    bool run_contexts = false; /* If set, replay each trace on a second context as well (set by -C) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util;
@@ -356,7 +390,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hOVlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:e:f:c:s:t:v:P:A:L:hOVlDTHBgMC")) != EOF) {
         switch (c) {
 
             case 'f': /* Use one specific trace file only (relative to curr dir) */
@@ -382,6 +416,42 @@ int main(int argc, char **argv)
                 run_libc = true;
                 break;
 
+            case 'H': /* Run mm malloc on huge pages as well */
+                run_huge = true;
+                break;
+
+            case 'P': /* Measure mm malloc in 1 to n threads at once */
+                run_threads = atoi(optarg);
+                break;
+
+            case 'B': /* Hand the frees of -P to the background thread */
+                run_background = true;
+                break;
+
+            case 'A': /* Force this many arenas for -P */
+                run_arenas = atoi(optarg);
+                break;
+
+            case 'L': /* Set the size from which requests get a region of their own */
+                if (!mm_set_large_threshold(strtoul(optarg, NULL, 0))) {
+                    fprintf(stderr, "Invalid large object threshold '%s'\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+
+            case 'g': /* Print the heap growth decisions of each trace */
+                show_growth = true;
+                break;
+
+            case 'M': /* Count the cache misses of each trace */
+                count_misses = true;
+                break;
+
+            case 'C': /* Replay each trace on a second context as well */
+                run_contexts = true;
+                break;
+
             case 'V': /* Increase verbosity level */
                 verbose += 1;
                 break;
@@ -398,6 +468,14 @@ int main(int argc, char **argv)
                 debug_mode = DBG_EXPENSIVE;
                 break;
 
+            case 'e': /* Select the allocator engine */
+                if (!mm_set_engine(optarg)) {
+                    fprintf(stderr, "Unknown allocator engine '%s'\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+
             case 's':
                 set_timeout = atoi(optarg);
                 break;
@@ -517,6 +595,20 @@ int main(int argc, char **argv)
         }
     }
 
+    /* Optionally show what utilization the heap growth policy traded for fewer sbrk calls */
+    if (show_growth && !onetime_flag) {
+        printf("\nHeap growth of mm malloc:\n");
+        printgrowth(num_global_tracefiles, mm_stats);
+        printf("\n");
+    }
+
+    /* Optionally show how many cache misses one timed run of each trace took */
+    if (count_misses && !onetime_flag) {
+        printf("\nCache misses of mm malloc:\n");
+        printmisses(num_global_tracefiles, mm_stats);
+        printf("\n");
+    }
+
     /* Optionally compare the performance of mm and libc */
     if (run_libc) {
         printf("Comparison with libc malloc: mm/libc = %.0f Kops / %.0f Kops = %.2f\n", 
@@ -524,6 +616,54 @@ int main(int argc, char **argv)
                (float)(global_mm_sum_stats.tput/global_libc_sum_stats.tput));
     }
 
+    /*
+     * Optionally run the mm package again with the heap on huge pages and
+     * compare its throughput, the scores stay those of the base pages
+     */
+    if (run_huge && !onetime_flag) {
+        sum_stats_t huge_sum_stats;
+        stats_t *huge_stats = (stats_t *)calloc(num_global_tracefiles, sizeof(stats_t));
+        if (huge_stats == NULL)
+            unix_error("huge_stats calloc in main failed");
+
+        if (verbose > 1)
+            printf("\nTesting mm malloc on huge pages\n");
+        mem_set_hugepages(true);
+        run_tests(num_global_tracefiles, tracedir, global_tracefiles, huge_stats,
+                  &speed_params);
+        mem_set_hugepages(false);
+
+        printf("\nResults for mm malloc on huge pages:\n");
+        printresults(num_global_tracefiles, huge_stats, &huge_sum_stats);
+        printf("\nComparison with huge pages: huge/base = %.0f Kops / %.0f Kops = %.2f\n",
+               (float)huge_sum_stats.tput, (float)global_mm_sum_stats.tput,
+               (float)(huge_sum_stats.tput/global_mm_sum_stats.tput));
+        free(huge_stats);
+    }
+
+    /*
+     * Optionally measure how the throughput of the mm package scales with
+     * the number of threads calling it at once
+     */
+    if (run_threads > 0)
+        eval_mm_threads(run_threads, run_background, run_arenas);
+
+    /*
+     * Optionally replay each trace on a context of its own alongside the
+     * default one, a failure counts as an error
+     */
+    if (run_contexts) {
+        printf("\nSecond context alongside the default one:\n");
+        for (i = 0; i < num_global_tracefiles; i++) {
+            stats_t context_stats;
+            mem_init();
+            trace_t *trace = read_trace(&context_stats, tracedir, global_tracefiles[i]);
+            printf("%-25s %s\n", trace->filename, eval_mm_contexts(trace) ? "ok" : "failed");
+            free_trace(trace);
+            mem_deinit();
+        }
+    }
+
     /*
      * Accumulate the aggregate statistics for the student's mm package
      */
@@ -691,11 +831,13 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or of a region
+       mapped apart from it */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_in_region(lo, size)) {
         malloc_error(trace, opnum,
-                     "Payload (%p:%p) lies outside heap (%p:%p)",
+                     "Payload (%p:%p) lies outside heap (%p:%p) and mapped regions",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
         return false;
     }
@@ -1159,15 +1301,143 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     return true;
 }
 
+/* Bytes of the stamp at the start of each block of the second context */
+#define STAMP_LEN(size) ((size) < sizeof(uint64_t) ? (size) : sizeof(uint64_t))
+
+/* Returns the stamp of the block with given index, cut to len bytes */
+static uint64_t context_stamp(int index, size_t len)
+{
+    uint64_t stamp = 0x5a5a5a5a00000000ULL | (uint32_t)index;
+    return (len < sizeof(uint64_t)) ? stamp & ((1ULL << (8 * len)) - 1) : stamp;
+}
+
+/*
+ * eval_mm_contexts - replays the trace on the default context and, one
+ *   operation behind each other, on a second context with a heap of its
+ *   own. Every block has to lie in the heap or regions of its context,
+ *   and the blocks of either context have to keep their data while the
+ *   other one changes
+ */
+static bool eval_mm_contexts(trace_t *trace)
+{
+    mem_heap_t *heap;
+    mm_context_t *context;
+    char **blocks;   /* Blocks of the second context */
+    char *p, *newp;
+    size_t size, oldsize;
+    int i, index;
+    bool ok = true;
+
+    mem_reset_brk();
+    reinit_trace(trace);
+    if (!mm_init()) {
+        malloc_error(trace, 0, "mm_init failed.");
+        return false;
+    }
+
+    if ((heap = mem_heap_create()) == NULL || (context = mm_context_create(heap)) == NULL)
+        unix_error("second context in eval_mm_contexts failed");
+    if ((blocks = (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+        unix_error("blocks calloc in eval_mm_contexts failed");
+    if (!mm_ctx_init(context)) {
+        malloc_error(trace, 0, "mm_ctx_init failed.");
+        ok = false;
+    }
+
+    for (i = 0; ok && i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        oldsize = (index < 0) ? 0 : trace->block_sizes[index];
+
+        /* Both blocks of the index still hold what was written to them */
+        if (!check_index(trace, i, index, 0))
+            ok = false;
+        else if (index >= 0 && blocks[index] != NULL && oldsize > 0 &&
+                 mem_read(blocks[index], STAMP_LEN(oldsize)) != context_stamp(index, STAMP_LEN(oldsize))) {
+            malloc_error(trace, i, "block of the second context lost its data");
+            ok = false;
+        }
+        if (!ok)
+            break;
+
+        switch (trace->ops[i].type) {
+
+            case ALLOC:
+            case REALLOC:
+                if (trace->ops[i].type == ALLOC) {
+                    p = mm_malloc(size);
+                    newp = mm_ctx_malloc(context, size);
+                } else {
+                    p = mm_realloc(trace->blocks[index], size);
+                    newp = mm_ctx_realloc(context, blocks[index], size);
+                }
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+                blocks[index] = newp;
+                if (size == 0)
+                    break;
+
+                if (p == NULL || newp == NULL) {
+                    malloc_error(trace, i, "allocation failed on one of the contexts");
+                    ok = false;
+                } else if (!mem_in_heap(p) && !mem_in_region(p, size)) {
+                    malloc_error(trace, i, "block of the default context outside its heap");
+                    ok = false;
+                } else if (!mem_in_heap_h(heap, newp) && !mem_in_region_h(heap, newp, size)) {
+                    malloc_error(trace, i, "block of the second context outside its heap");
+                    ok = false;
+                } else if (trace->ops[i].type == REALLOC && oldsize > 0 &&
+                           mem_read(newp, STAMP_LEN(oldsize < size ? oldsize : size)) !=
+                           context_stamp(index, STAMP_LEN(oldsize < size ? oldsize : size))) {
+                    malloc_error(trace, i, "mm_ctx_realloc did not preserve the data");
+                    ok = false;
+                } else {
+                    randomize_block(trace, index);
+                    mem_write(newp, context_stamp(index, STAMP_LEN(size)), STAMP_LEN(size));
+                }
+                break;
+
+            case FREE:
+                mm_free((index < 0) ? NULL : trace->blocks[index]);
+                mm_ctx_free(context, (index < 0) ? NULL : blocks[index]);
+                if (index >= 0) {
+                    trace->blocks[index] = NULL;
+                    trace->block_sizes[index] = 0;
+                    blocks[index] = NULL;
+                }
+                break;
+
+            default:
+                app_error("Nonexistent request type in eval_mm_contexts");
+        }
+
+        if (ok && debug_mode == DBG_EXPENSIVE &&
+            (!mm_checkheap(0) || !mm_ctx_checkheap(context, 0))) {
+            malloc_error(trace, i, "mm_checkheap returned false on one of the contexts");
+            ok = false;
+        }
+    }
+
+    if (ok && (!mm_checkheap(0) || !mm_ctx_checkheap(context, 0))) {
+        malloc_error(trace, trace->num_ops - 1, "mm_checkheap returned false on one of the contexts");
+        ok = false;
+    }
+
+    free(blocks);
+    mm_context_destroy(context);
+    mem_heap_destroy(heap);
+    return ok;
+}
+
 /*
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   peak size of the heap in bytes while running the student's malloc
+ *   package on the trace. The heap can shrink, so its size is sampled
+ *   after every request. Regions mapped apart from the heap come and
+ *   go, so each sample is the heap plus the regions mapped at the time.
  *
  *   A higher number is better: 1 is optimal.
  */
@@ -1250,7 +1520,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size = (total_size > max_total_size) ?
             total_size : max_total_size;
-        heap_size = mem_heapsize();
+        heap_size = mem_heapsize() + mem_mapsize();
         max_heap_size = (heap_size > max_heap_size) ?
             heap_size : max_heap_size;
     }
@@ -1316,6 +1586,204 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+#ifdef MM_THREADS
+/* Free latencies in ns timed by each thread of the scaling benchmark */
+static long *thread_latency;
+
+/* Returns the time of a monotonic clock in ns */
+static long thread_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * eval_mm_thread - one thread of the scaling benchmark, keeps replacing a random
+ *    one of its blocks with a block of random size until it made THREAD_OPS calls,
+ *    and times one free in THREAD_SAMPLE
+ */
+static void *eval_mm_thread(void *arg)
+{
+    long t = (long)arg, start;
+    unsigned int seed = (unsigned int)(t + 1);
+    long *latency = thread_latency + t * (THREAD_OPS / 2 / THREAD_SAMPLE);
+    char *blocks[THREAD_SLOTS] = {NULL};
+    int i, slot;
+
+    for (i = 0; i < THREAD_OPS / 2; i++) {
+        slot = rand_r(&seed) % THREAD_SLOTS;
+        if (i % THREAD_SAMPLE == 0) {
+            start = thread_clock();
+            mm_free(blocks[slot]);
+            latency[i / THREAD_SAMPLE] = thread_clock() - start;
+        } else {
+            mm_free(blocks[slot]);
+        }
+        if ((blocks[slot] = mm_malloc(1 + rand_r(&seed) % THREAD_SIZE)) == NULL)
+            app_error("mm_malloc error in eval_mm_thread");
+        blocks[slot][0] = (char)i;
+    }
+    for (slot = 0; slot < THREAD_SLOTS; slot++)
+        mm_free(blocks[slot]);
+    return NULL;
+}
+
+/* Blocks the producer handed over, how many it handed and the consumer took */
+static char *handoff_blocks[HANDOFF_OPS];
+static long handoff_given, handoff_taken;
+static bool handoff_failed;
+
+/*
+ * eval_mm_producer - allocates blocks of 128 bytes and up, stamps them and hands them
+ *    to the consumer, never more than THREAD_SLOTS ahead of it
+ */
+static void *eval_mm_producer(void *arg)
+{
+    unsigned int seed = 1;
+    char *p;
+    long i;
+
+    for (i = 0; i < HANDOFF_OPS; i++) {
+        while (i - __atomic_load_n(&handoff_taken, __ATOMIC_ACQUIRE) >= THREAD_SLOTS)
+            sched_yield();
+        if ((p = mm_malloc(128 + rand_r(&seed) % (THREAD_SIZE - 128))) == NULL)
+            app_error("mm_malloc error in eval_mm_producer");
+        p[0] = (char)i;
+        handoff_blocks[i] = p;
+        __atomic_store_n(&handoff_given, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * eval_mm_consumer - frees the blocks of the producer, which come from another arena,
+ *    and keeps a few 64 byte blocks of its own meanwhile, so its thread cache holds
+ *    blocks of both arenas whenever it is flushed
+ */
+static void *eval_mm_consumer(void *arg)
+{
+    char *own[8] = {NULL};
+    char *p;
+    long i;
+
+    for (i = 0; i < HANDOFF_OPS; i++) {
+        while (__atomic_load_n(&handoff_given, __ATOMIC_ACQUIRE) <= i)
+            sched_yield();
+        p = handoff_blocks[i];
+        if (p[0] != (char)i)
+            handoff_failed = true;
+        mm_free(p);
+        __atomic_store_n(&handoff_taken, i + 1, __ATOMIC_RELEASE);
+
+        mm_free(own[i % 8]);
+        if ((own[i % 8] = mm_malloc(64)) == NULL)
+            app_error("mm_malloc error in eval_mm_consumer");
+        own[i % 8][0] = (char)i;
+        if (i >= 8 && own[(i + 1) % 8][0] != (char)(i - 7))
+            handoff_failed = true;
+    }
+    for (i = 0; i < 8; i++)
+        mm_free(own[i]);
+    return NULL;
+}
+
+/*
+ * eval_mm_handoff - runs a producer thread that allocates and a consumer thread
+ *    that frees on a fresh heap, returns false if a block lost its stamp or the
+ *    heap checker fails afterwards
+ */
+static bool eval_mm_handoff(void)
+{
+    pthread_t producer, consumer;
+    bool ok;
+
+    mem_init();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_handoff");
+    handoff_given = handoff_taken = 0;
+    handoff_failed = false;
+
+    if (pthread_create(&producer, NULL, eval_mm_producer, NULL) != 0 ||
+        pthread_create(&consumer, NULL, eval_mm_consumer, NULL) != 0)
+        unix_error("pthread_create in eval_mm_handoff failed");
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+
+    ok = !handoff_failed && mm_checkheap(0);
+    mem_deinit();
+    return ok;
+}
+#endif /* MM_THREADS */
+
+/*
+ * eval_mm_threads - runs the scaling benchmark in 1 to max_threads threads
+ *    at once, each time on a fresh heap, and prints the throughput of all the
+ *    threads together, its speedup over a single thread and the 99th percentile
+ *    of the timed frees. With background set, the background thread takes the frees.
+ *    A producer and consumer pair then checks frees across arenas. With arenas
+ *    set, that many arenas are forced whatever CPUs the threads run on
+ */
+static void eval_mm_threads(int max_threads, bool background, int arenas)
+{
+#ifdef MM_THREADS
+    long samples = THREAD_OPS / 2 / THREAD_SAMPLE;
+    pthread_t *threads = (pthread_t *)calloc(max_threads, sizeof(pthread_t));
+    long start, end;
+    double kops, base = 0;
+    int n, t;
+
+    thread_latency = (long *)calloc(max_threads * samples, sizeof(long));
+    if (threads == NULL || thread_latency == NULL)
+        unix_error("threads calloc in eval_mm_threads failed");
+    if (!mm_set_arenas(arenas))
+        app_error("mm_set_arenas failed in eval_mm_threads");
+
+    printf("\nThread scaling of mm malloc (%d calls per thread%s):\n", THREAD_OPS,
+           background ? ", background free" : "");
+    printf("%8s%12s%10s%14s\n", "threads", "Kops", "speedup", "free p99 ns");
+    for (n = 1; n <= max_threads; n++) {
+        mem_init();
+        if (!mm_init())
+            app_error("mm_init failed in eval_mm_threads");
+        if (background && !mm_set_background_free(true))
+            app_error("mm_set_background_free failed in eval_mm_threads");
+
+        start = thread_clock();
+        for (t = 0; t < n; t++)
+            if (pthread_create(&threads[t], NULL, eval_mm_thread, (void *)(long)t) != 0)
+                unix_error("pthread_create in eval_mm_threads failed");
+        for (t = 0; t < n; t++)
+            pthread_join(threads[t], NULL);
+        end = thread_clock();
+
+        /* The blocks still waiting for the background thread go before the heap */
+        if (background)
+            mm_set_background_free(false);
+
+        kops = (double)n * THREAD_OPS / ((end - start) * 1e-9) * 0.001;
+        if (n == 1)
+            base = kops;
+        qsort(thread_latency, n * samples, sizeof(long), compare_long);
+        printf("%8d%12.0f%10.2f%14ld\n", n, kops, kops / base, thread_latency[n * samples * 99 / 100]);
+        mem_deinit();
+    }
+
+    printf("Producer/consumer across arenas: %s\n", eval_mm_handoff() ? "ok" : "failed");
+    mm_set_arenas(0);
+    free(thread_latency);
+    free(threads);
+#else
+    app_error("mdriver -P needs the thread safe allocator, build with THREADS=1");
+#endif
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1585,6 +2053,105 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     }
 }
 
+/*
+ * printgrowth - prints how often and how far the heap grew on each valid trace next to
+ *               its utilization, and how many of the bytes grown it was actually short of
+ */
+static void printgrowth(int n, stats_t *stats)
+{
+    int i;
+
+    if (tab_mode)
+        printf("util\tgrows\tgrownKB\tneededKB\tchunkKB\ttrace\n");
+    else
+        printf("  %6s %7s %9s %9s %8s  %s\n",
+               "util", "grows", "grown KB", "needed KB", "chunk KB", "trace");
+
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        if (tab_mode)
+            printf("%.1f\t%ld\t%.1f\t%.1f\t%.0f\t%s\n",
+                   stats[i].util * 100.0, stats[i].growth.grows,
+                   stats[i].growth.grown / 1024.0, stats[i].growth.needed / 1024.0,
+                   stats[i].growth.max_chunk / 1024.0, stats[i].filename);
+        else
+            printf(" %6.1f%% %7ld %9.1f %9.1f %8.0f  %s\n",
+                   stats[i].util * 100.0, stats[i].growth.grows,
+                   stats[i].growth.grown / 1024.0, stats[i].growth.needed / 1024.0,
+                   stats[i].growth.max_chunk / 1024.0, stats[i].filename);
+    }
+}
+
+/*
+ * eval_mm_misses - counts the cache misses of one more timed run of a trace with the
+ *                  hardware counter of the kernel, returns -1 and sets misses_errno if
+ *                  the counter cannot be opened
+ */
+static long long eval_mm_misses(speed_t *speed_params)
+{
+    struct perf_event_attr attr;
+    long long misses;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+        misses_errno = errno;
+        return -1;
+    }
+
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    eval_mm_speed(speed_params);
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+        misses_errno = errno;
+        misses = -1;
+    }
+    close(fd);
+
+    return misses;
+}
+
+/*
+ * printmisses - prints the cache misses of one timed run of each valid trace and
+ *               how many that is per operation
+ */
+static void printmisses(int n, stats_t *stats)
+{
+    int i;
+
+    if (tab_mode)
+        printf("misses\tper op\ttrace\n");
+    else
+        printf(" %12s %8s  %s\n", "misses", "per op", "trace");
+
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        if (stats[i].misses < 0 && tab_mode)
+            printf("n/a\tn/a\t%s\n", stats[i].filename);
+        else if (stats[i].misses < 0)
+            printf(" %12s %8s  %s\n", "n/a", "n/a", stats[i].filename);
+        else if (tab_mode)
+            printf("%lld\t%.3f\t%s\n", stats[i].misses,
+                   stats[i].misses / stats[i].ops, stats[i].filename);
+        else
+            printf(" %12lld %8.3f  %s\n", stats[i].misses,
+                   stats[i].misses / stats[i].ops, stats[i].filename);
+    }
+    if (misses_errno != 0)
+        printf("Cache misses could not be counted: %s\n", strerror(misses_errno));
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1796,14 +2363,23 @@ static double measure_ref_throughput() {
  */
 static void usage(char *prog)
 {
-    fprintf(stderr, "Usage: %s [-hlVdD] [-f <file>]\n", prog);
+    fprintf(stderr, "Usage: %s [-hlHVdDBgMC] [-P <n>] [-A <n>] [-L <bytes>] [-f <file>]\n", prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
+    fprintf(stderr, "\t-e <name>  Use allocator engine <name>: freelist or buddy.\n");
     fprintf(stderr, "\t-c <file>  Run trace file <file> once, check for correctness only.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-H         Run mm malloc on huge pages as well and compare.\n");
+    fprintf(stderr, "\t-P <n>     Measure mm malloc in 1 to <n> threads (needs THREADS=1).\n");
+    fprintf(stderr, "\t-B         Hand the frees of -P to the background thread.\n");
+    fprintf(stderr, "\t-A <n>     Force n arenas for -P.\n");
+    fprintf(stderr, "\t-L <bytes> Map a region of its own for requests of at least <bytes>.\n");
+    fprintf(stderr, "\t-g         Print the heap growth decisions of each trace.\n");
+    fprintf(stderr, "\t-M         Count the cache misses of each trace.\n");
+    fprintf(stderr, "\t-C         Replay each trace on a second context as well.\n");
     fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
@@ -4,6 +4,7 @@
  * package with the system's malloc package in libc.
  *
  */
+#define _GNU_SOURCE /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -18,17 +19,57 @@
 #include "memlib.h"
 #include "config.h"
 
+/* Size of a huge page, the step the heap is backed in when huge pages are on */
+#define HUGE_PAGE_SIZE (1ull << 21)
+
+/* Regions mapped apart from the heap, see mem_map_region */
+typedef struct {
+    unsigned char *addr;
+    size_t size;
+} region_t;
+
+/* A heap instance, the default one is used by the functions without a handle */
+struct mem_heap {
+    unsigned char *mapping;                 /* Start of the heap reservation */
+    size_t mapping_size;                    /* Size of the heap reservation */
+    bool hugepages;                         /* Backed by huge pages */
+    unsigned char *heap;                    /* Starting address of heap */
+    unsigned char *brk;                     /* Current position of break */
+    unsigned char *max_addr;                /* Maximum allowable heap address */
+    unsigned char *commit;                  /* End of the prefaulted part of the heap */
+    size_t prefaulted;                      /* Bytes faulted in ahead of time */
+    region_t *regions;                      /* Live regions in no particular order */
+    size_t region_count;                    /* Number of live regions */
+    size_t region_capacity;                 /* Room in the regions array */
+    size_t mapped;                          /* Bytes in live regions */
+};
+
 /* private global variables */
-static unsigned char *heap;                 /* Starting address of heap */
-static unsigned char *mem_brk;              /* Current position of break */
-static unsigned char *mem_max_addr;         /* Maximum allowable heap address */
+static mem_heap_t mem_default;              /* Heap of mem_init and the functions without a handle */
+static bool mem_hugepages;                  /* Back the next heap with huge pages */
+static size_t mem_prefault_batch = PREFAULT_BATCH; /* Bytes faulted in past the break */
 
-/* 
- * mem_init - initialize the memory system model
+/*
+ * mem_set_hugepages - picks whether the heap of the next mem_init or
+ *              mem_heap_create is backed by huge pages
  */
-void mem_init(){
+void mem_set_hugepages(bool on){
+    mem_hugepages = on;
+}
+
+/*
+ * heap_setup - reserves the address space of a heap and makes it empty.
+ *              With huge pages on, the heap starts on a huge page boundary
+ *              and is advised to be backed by transparent huge pages, so
+ *              every aligned 2 MB step of it faults in as one page. Base
+ *              pages remain if the kernel doesn't support that.
+ */
+static void heap_setup(mem_heap_t *h){
+    memset(h, 0, sizeof(*h));
+    h->hugepages = mem_hugepages;
+    h->mapping_size = MAX_HEAP_SIZE + (h->hugepages ? HUGE_PAGE_SIZE : 0);
     unsigned char* addr = mmap(NULL,                                        /* start*/
-                               MAX_HEAP_SIZE,                               /* length */
+                               h->mapping_size,                             /* length */
                                PROT_READ | PROT_WRITE,                      /* permissions */
                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, /* flags */
                                -1,                                          /* fd */
@@ -37,47 +78,183 @@ void mem_init(){
 	fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
 	exit(1);
     }
-    heap = addr;
-    mem_max_addr = addr + MAX_HEAP_SIZE;
-    mem_reset_brk();
+    h->mapping = addr;
+    h->heap = addr;
+    if (h->hugepages) {
+        h->heap = (unsigned char *) (((uintptr_t) addr + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+        if (madvise(h->heap, MAX_HEAP_SIZE, MADV_HUGEPAGE) != 0)
+            fprintf(stderr, "WARNING: madvise couldn't back the heap with huge pages, using base pages\n");
+    }
+    h->max_addr = h->heap + MAX_HEAP_SIZE;
+    h->commit = h->heap;
+    mem_reset_brk_h(h);
 }
 
-/* 
- * mem_deinit - free the storage used by the memory system model
+/*
+ * heap_teardown - unmaps a heap and every region still mapped for it
  */
-void mem_deinit(void){
-    if (munmap(heap, MAX_HEAP_SIZE) != 0) {
+static void heap_teardown(mem_heap_t *h){
+    mem_reset_brk_h(h);
+    free(h->regions);
+    h->regions = NULL;
+    h->region_capacity = 0;
+    if (munmap(h->mapping, h->mapping_size) != 0) {
         fprintf(stderr, "FAILURE.  munmap couldn't deallocate heap space\n");
         exit(1);
     }
 }
 
+/* 
+ * mem_init - initialize the memory system model
+ */
+void mem_init(){
+    heap_setup(&mem_default);
+}
+
+/* 
+ * mem_deinit - free the storage used by the memory system model
+ */
+void mem_deinit(void){
+    heap_teardown(&mem_default);
+}
+
+/*
+ * mem_heap_create - reserves a heap instance of its own next to the
+ *              default one, returns NULL on error
+ */
+mem_heap_t *mem_heap_create(void){
+    mem_heap_t *h = mem_meta_map(sizeof(mem_heap_t));
+    if (h != NULL)
+        heap_setup(h);
+    return h;
+}
+
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_heap_destroy - unmaps a heap instance from mem_heap_create
  */
+void mem_heap_destroy(mem_heap_t *h){
+    heap_teardown(h);
+    mem_meta_unmap(h, sizeof(mem_heap_t));
+}
+
+/*
+ * mem_default_heap - returns the heap of mem_init
+ */
+mem_heap_t *mem_default_heap(void){
+    return &mem_default;
+}
+
+/*
+ * mem_meta_map - maps size bytes of zeroed memory for bookkeeping that
+ *              lives apart from every heap and counts in no footprint,
+ *              returns NULL on error
+ */
+void *mem_meta_map(size_t size){
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (addr == MAP_FAILED) ? NULL : addr;
+}
+
+/*
+ * mem_meta_unmap - unmaps memory from mem_meta_map
+ */
+void mem_meta_unmap(void *addr, size_t size){
+    munmap(addr, size);
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *              every region still mapped is unmapped as well
+ */
+void mem_reset_brk_h(mem_heap_t *h){
+    h->brk = h->heap;
+    while (h->region_count > 0)
+        mem_unmap_region_h(h, h->regions[0].addr, h->regions[0].size);
+}
+
 void mem_reset_brk(){
-    mem_brk = heap;
+    mem_reset_brk_h(&mem_default);
+}
+
+/*
+ * mem_set_prefault - sets how many bytes past the break mem_sbrk faults in
+ *              ahead of time, 0 to leave every page to fault on first touch
+ */
+void mem_set_prefault(size_t batch) {
+    mem_prefault_batch = batch;
+}
+
+/*
+ * mem_prefaulted - returns the bytes faulted in ahead of the break since
+ *              the heap was set up
+ */
+size_t mem_prefaulted_h(mem_heap_t *h) {
+    return h->prefaulted;
+}
+
+size_t mem_prefaulted(void) {
+    return mem_prefaulted_h(&mem_default);
+}
+
+/*
+ * prefault - faults in one batch of the heap from the old break, or from the
+ *              end of its prefaulted part if that lies past it, in whole pages
+ *              of the heap. A large sbrk is left to fault on first touch
+ *              beyond that batch. Kernels without MADV_POPULATE_WRITE get
+ *              every page touched.
+ */
+static void prefault(mem_heap_t *h, unsigned char *old_brk) {
+    size_t page = mem_pagesize_h(h);
+    unsigned char *lo = (old_brk > h->commit) ? old_brk : h->commit;
+    lo = (unsigned char *) ((uintptr_t) lo & ~(uintptr_t) (page - 1));
+    unsigned char *hi = (unsigned char *) (((uintptr_t) lo + mem_prefault_batch + page - 1) & ~(uintptr_t) (page - 1));
+
+    if (hi > h->max_addr)
+        hi = h->max_addr;
+    if (hi <= lo)
+        return;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(lo, hi - lo, MADV_POPULATE_WRITE) != 0)
+#endif
+    for (volatile unsigned char *p = lo; p < hi; p += mem_pagesize())
+        *p = *p;
+
+    h->prefaulted += hi - lo;
+    h->commit = hi;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		by incr bytes and returns the start address of the new area. A
+ *		negative incr shrinks the heap, and the whole pages it gives up
+ *		are handed back to the kernel with madvise.
  */
-void *mem_sbrk(intptr_t incr) {
-    unsigned char *old_brk = mem_brk;
+void *mem_sbrk_h(mem_heap_t *h, intptr_t incr) {
+    unsigned char *old_brk = h->brk;
 
     bool ok = true;
-    if (incr < 0) {
+    if (incr < 0 && h->brk + incr < h->heap) {
 	ok = false;
-	fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
-    } else if (mem_brk + incr > mem_max_addr) {
+	fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld below its start\n", (long) incr);
+    } else if (incr < 0) {
+	/* Releasing part of a huge page would split it, only whole ones go */
+	size_t page = mem_pagesize_h(h);
+	uintptr_t lo = ((uintptr_t) (h->brk + incr) + page - 1) / page * page;
+	uintptr_t hi = ((uintptr_t) h->brk + page - 1) / page * page;
+	if (lo < hi && madvise((void *) lo, hi - lo, MADV_DONTNEED) != 0)
+	    fprintf(stderr, "WARNING: mem_sbrk couldn't release the pages given up at %p\n", (void *) lo);
+	if (lo < hi && (unsigned char *) lo < h->commit)
+	    h->commit = (unsigned char *) lo;
+    } else if (h->brk + incr > h->max_addr) {
 	ok = false;
-	long alloc = mem_brk - heap + incr;
+	long alloc = h->brk - h->heap + incr;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
     }
     if (ok) {
-	mem_brk += incr;
+	h->brk += incr;
+	if (mem_prefault_batch > 0 && h->brk > h->commit)
+	    prefault(h, old_brk);
 	return (void *) old_brk;
     } else {
 	errno = ENOMEM;
@@ -85,25 +262,207 @@ void *mem_sbrk(intptr_t incr) {
     }
 }
 
+void *mem_sbrk(intptr_t incr) {
+    return mem_sbrk_h(&mem_default, incr);
+}
+
+/*
+ * mem_map_region - maps a region of at least size bytes apart from the
+ *              heap and returns its page-aligned start, or NULL on error.
+ *              The size is rounded up to whole pages and counts toward
+ *              the footprint of the heap until the region is unmapped.
+ */
+void *mem_map_region_h(mem_heap_t *h, size_t size) {
+    size_t page = mem_pagesize();
+    size = (size + page - 1) / page * page;
+
+    if (h->region_count == h->region_capacity) {
+        size_t capacity = h->region_capacity ? 2 * h->region_capacity : 64;
+        region_t *grown = realloc(h->regions, capacity * sizeof(region_t));
+        if (grown == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        h->regions = grown;
+        h->region_capacity = capacity;
+    }
+
+    unsigned char *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_map_region failed.  mmap couldn't map %zd (0x%zx) bytes\n", size, size);
+	return NULL;
+    }
+
+    h->regions[h->region_count].addr = addr;
+    h->regions[h->region_count].size = size;
+    h->region_count += 1;
+    h->mapped += size;
+    return (void *) addr;
+}
+
+void *mem_map_region(size_t size) {
+    return mem_map_region_h(&mem_default, size);
+}
+
+/*
+ * mem_unmap_region - unmaps a region returned by mem_map_region, size
+ *              being the size it was mapped with. Returns false if there
+ *              is no such region.
+ */
+bool mem_unmap_region_h(mem_heap_t *h, void *addr, size_t size) {
+    size_t page = mem_pagesize();
+    size = (size + page - 1) / page * page;
+
+    for (size_t i = 0; i < h->region_count; i++) {
+        if (h->regions[i].addr != addr || h->regions[i].size != size)
+            continue;
+        if (munmap(addr, size) != 0) {
+            fprintf(stderr, "ERROR: mem_unmap_region failed.  munmap couldn't unmap %p\n", addr);
+            return false;
+        }
+        h->regions[i] = h->regions[--h->region_count];
+        h->mapped -= size;
+        return true;
+    }
+    fprintf(stderr, "ERROR: mem_unmap_region failed.  %p is not a mapped region\n", addr);
+    return false;
+}
+
+bool mem_unmap_region(void *addr, size_t size) {
+    return mem_unmap_region_h(&mem_default, addr, size);
+}
+
+/*
+ * mem_remap_region - resizes a region returned by mem_map_region from size
+ *              to at least new_size bytes. If it can't be resized where it
+ *              is, its pages move to a new address instead of being copied.
+ *              Returns the possibly moved start of the region, or NULL on
+ *              error with the region left as it was.
+ */
+void *mem_remap_region_h(mem_heap_t *h, void *addr, size_t size, size_t new_size) {
+    size_t page = mem_pagesize();
+    size = (size + page - 1) / page * page;
+    new_size = (new_size + page - 1) / page * page;
+
+    for (size_t i = 0; i < h->region_count; i++) {
+        if (h->regions[i].addr != addr || h->regions[i].size != size)
+            continue;
+        unsigned char *new_addr = mremap(addr, size, new_size, MREMAP_MAYMOVE);
+        if (new_addr == MAP_FAILED) {
+            fprintf(stderr, "ERROR: mem_remap_region failed.  mremap couldn't resize %p to %zd (0x%zx) bytes\n", addr, new_size, new_size);
+            return NULL;
+        }
+        h->regions[i].addr = new_addr;
+        h->regions[i].size = new_size;
+        h->mapped += new_size - size;
+        return (void *) new_addr;
+    }
+    fprintf(stderr, "ERROR: mem_remap_region failed.  %p is not a mapped region\n", addr);
+    return NULL;
+}
+
+void *mem_remap_region(void *addr, size_t size, size_t new_size) {
+    return mem_remap_region_h(&mem_default, addr, size, new_size);
+}
+
+/*
+ * mem_in_region - returns whether the size bytes at addr lie within a
+ *              single mapped region
+ */
+bool mem_in_region_h(mem_heap_t *h, const void *addr, size_t size) {
+    const unsigned char *lo = addr;
+
+    for (size_t i = 0; i < h->region_count; i++) {
+        if (lo >= h->regions[i].addr && lo + size <= h->regions[i].addr + h->regions[i].size)
+            return true;
+    }
+    return false;
+}
+
+bool mem_in_region(const void *addr, size_t size) {
+    return mem_in_region_h(&mem_default, addr, size);
+}
+
+/*
+ * mem_mapsize - returns the bytes in mapped regions
+ */
+size_t mem_mapsize_h(mem_heap_t *h) {
+    return h->mapped;
+}
+
+size_t mem_mapsize(void) {
+    return mem_mapsize_h(&mem_default);
+}
+
+/*
+ * mem_decommit - hands the whole pages within the size bytes at addr back
+ *              to the kernel, huge pages on a heap backed by them so none
+ *              is split. They stay mapped and fault back in zeroed when
+ *              next touched. Returns false on error.
+ */
+bool mem_decommit_h(mem_heap_t *h, void *addr, size_t size) {
+    size_t page = mem_pagesize_h(h);
+    uintptr_t lo = ((uintptr_t) addr + page - 1) / page * page;
+    uintptr_t hi = ((uintptr_t) addr + size) / page * page;
+
+    if (lo >= hi)
+        return true;
+    if (madvise((void *) lo, hi - lo, MADV_DONTNEED) != 0) {
+        fprintf(stderr, "WARNING: mem_decommit couldn't release the pages at %p\n", (void *) lo);
+        return false;
+    }
+    return true;
+}
+
+bool mem_decommit(void *addr, size_t size) {
+    return mem_decommit_h(&mem_default, addr, size);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
+void *mem_heap_lo_h(mem_heap_t *h){
+    return (void *) h->heap;
+}
+
 void *mem_heap_lo(){
-    return (void *) heap;
+    return mem_heap_lo_h(&mem_default);
 }
 
 /* 
  * mem_heap_hi - return address of last heap byte
  */
+void *mem_heap_hi_h(mem_heap_t *h){
+    return (void *)(h->brk - 1);
+}
+
 void *mem_heap_hi(){
-    return (void *)(mem_brk - 1);
+    return mem_heap_hi_h(&mem_default);
+}
+
+/*
+ * mem_in_heap - returns whether the address lies in the space reserved for the
+ *              heap, below the break or past it. Only reads what stays fixed
+ *              for the life of the heap, so it needs no lock
+ */
+bool mem_in_heap_h(mem_heap_t *h, const void *addr){
+    return (const unsigned char *) addr >= h->heap && (const unsigned char *) addr < h->max_addr;
+}
+
+bool mem_in_heap(const void *addr){
+    return mem_in_heap_h(&mem_default, addr);
 }
 
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
+size_t mem_heapsize_h(mem_heap_t *h) {
+    return (size_t)(h->brk - h->heap);
+}
+
 size_t mem_heapsize() {
-    return (size_t)(mem_brk - heap);
+    return mem_heapsize_h(&mem_default);
 }
 
 /*
@@ -113,6 +472,14 @@ size_t mem_pagesize(){
     return (size_t) getpagesize();
 }
 
+/*
+ * mem_pagesize_h - returns the size of the pages backing the heap, huge
+ *              pages for a heap backed by them
+ */
+size_t mem_pagesize_h(mem_heap_t *h){
+    return h->hugepages ? HUGE_PAGE_SIZE : mem_pagesize();
+}
+
 /*************** Memory emulation  *******************/
 
 /* Read len bytes and return value zero-extended to 64 bits */
@@ -2,14 +2,54 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+void mem_set_hugepages(bool on);
 void mem_init();               
 void mem_deinit(void);
 void *mem_sbrk(intptr_t incr);
+void mem_set_prefault(size_t batch);
+size_t mem_prefaulted(void);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+bool mem_in_heap(const void *addr);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+bool mem_decommit(void *addr, size_t size);
+
+/* Regions mapped apart from the heap, for objects too large to keep in it */
+void *mem_map_region(size_t size);
+bool mem_unmap_region(void *addr, size_t size);
+void *mem_remap_region(void *addr, size_t size, size_t new_size);
+bool mem_in_region(const void *addr, size_t size);
+size_t mem_mapsize(void);
+
+/*
+ * Heap instances. The functions above work on the default heap of mem_init,
+ * the ones ending in _h on the given instance
+ */
+typedef struct mem_heap mem_heap_t;
+
+mem_heap_t *mem_heap_create(void);
+void mem_heap_destroy(mem_heap_t *h);
+mem_heap_t *mem_default_heap(void);
+void *mem_sbrk_h(mem_heap_t *h, intptr_t incr);
+size_t mem_prefaulted_h(mem_heap_t *h);
+void mem_reset_brk_h(mem_heap_t *h);
+void *mem_heap_lo_h(mem_heap_t *h);
+void *mem_heap_hi_h(mem_heap_t *h);
+bool mem_in_heap_h(mem_heap_t *h, const void *addr);
+size_t mem_heapsize_h(mem_heap_t *h);
+void *mem_map_region_h(mem_heap_t *h, size_t size);
+bool mem_unmap_region_h(mem_heap_t *h, void *addr, size_t size);
+void *mem_remap_region_h(mem_heap_t *h, void *addr, size_t size, size_t new_size);
+bool mem_in_region_h(mem_heap_t *h, const void *addr, size_t size);
+size_t mem_mapsize_h(mem_heap_t *h);
+size_t mem_pagesize_h(mem_heap_t *h);
+bool mem_decommit_h(mem_heap_t *h, void *addr, size_t size);
+
+/* Memory for bookkeeping kept apart from every heap, such as heap instances */
+void *mem_meta_map(size_t size);
+void mem_meta_unmap(void *addr, size_t size);
 
 /* Functions used for memory emulation */
 
@@ -14,6 +14,7 @@
 
  *
  */
+#define _GNU_SOURCE /* for sched_getcpu */
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,9 +22,16 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdint.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "buddy.h"
+#include "growth.h"
 
 /*
  * If you want to enable your debugging output and heap checker code,
@@ -54,47 +62,391 @@
 #endif /* DRIVER */
 
 #define ALIGNMENT 16
-// Size of chunk, head/foot, and double head/foot
+// Size of head/foot, of a word of payload, and of two words. Building with MM_COMPRESSED packs
+// every header and footer into 32 bits and keeps the free list links as 32 bit offsets from the
+// heap start, which holds as long as the heap stays below COMPRESSED_LIMIT. The heap never grows
+// past that, requests it can't serve any more get a region apart from the heap like large objects,
+// whose headers keep full sizes, so only the heap itself is limited to 4GB
+#ifdef MM_COMPRESSED
+typedef uint32_t tag_t;
+size_t HEAD_SIZE = 4;
+#else
+typedef uint64_t tag_t;
 size_t HEAD_SIZE = 8;
-size_t DHEAD_SIZE = 16;  
-
-// Initialization of the starting address for the heap
-static char *heap_start;
-
-// Initialization of the starting and ending address of the free list
-static char *free_list_lo, *free_list_hi;
+#endif
+size_t WORD_SIZE = 8;
+size_t DHEAD_SIZE = 16;
+uint64_t COMPRESSED_LIMIT = (1ULL << 32) - ALIGNMENT;
+
+// Size of a mini block, a header and at least one word of payload. A free mini block has no room
+// for a footer or two links, so it sits on a singly linked list in its own size class
+size_t MINI_SIZE = 16;
+
+// Allocator engine every call goes to. The free list engine below is the default, building
+// with MM_ENGINE_BUDDY makes it the buddy engine and mm_set_engine picks one at run time. The
+// buddy engine keeps a single heap, the default one
+enum engine { ENGINE_FREELIST, ENGINE_BUDDY };
+
+// Free blocks are indexed by a two-level segregated fit (TLSF) table. The first
+// level splits sizes into power of two classes, the second level splits each of
+// those linearly into SL_COUNT lists, and a bitmap per level marks non-empty lists
+#define SL_LOG 3
+#define SL_COUNT (1 << SL_LOG)
+#define FL_SHIFT (SL_LOG + 4)
+#define FL_COUNT (64 - FL_SHIFT + 1)
+
+// Sizes below this are all kept in first level class 0, one list per ALIGNMENT step
+size_t SMALL_BLOCK_SIZE = (1 << FL_SHIFT);
+
+// Number of entries of the exact size class checked before rounding the search up
+int FIT_PROBES = 8;
+
+// Free blocks of at least this size are kept in best fit trees instead of lists. Every
+// class from this size up holds an AVL tree ordered by size and then by address
+size_t TREE_MIN_SIZE = 1024;
+
+// Free mini blocks are spread over several singly linked lists by address, so removing one
+// from the middle only walks a short list. The mini size class holds the head of the lowest
+// non-empty one
+#define MINI_LISTS 64
+
+// Small requests of a size class that has seen enough of them are served from slab pages. A
+// slab page is an allocated block of one page whose payload starts on a page boundary, so the
+// header of the block after it takes the last word of the page. The payload holds a header with
+// the slot size, the number of free slots, the links of its class list and a bitmap of free
+// slots, followed by equal slots that carry no header of their own
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_CLASSES 32
+#define SLAB_BITMAP_WORDS 4
+#define SLAB_MAP_PAGES (1 << 20)
+size_t SLAB_HEADER_SIZE = 64;
+size_t SLAB_BLOCK_SIZE = SLAB_PAGE_SIZE;
+long SLAB_THRESHOLD = 256;
+
+// Medium requests get a run of whole run pages, an allocated block of a multiple of the run
+// page size whose payload starts on a run page boundary, so medium objects never share a page
+// with small ones. Free runs stay off the free index on lists by page count, the last list
+// holding every longer run, and page maps mark the first page of every run and of every free
+// run so free can tell a run from a block and merge it with the free runs around it. Runs
+// start at four pages, below that rounding to whole pages wastes more than the segregation saves
+#define RUN_PAGE_SIZE 4096
+#define RUN_CLASSES 64
+#define RUN_MAP_PAGES (1 << 20)
+size_t RUN_MIN_SIZE = 16384;
+size_t RUN_MAX_SIZE = (1 << 20);
+
+// Freed blocks of up to QUICK_LISTS alignment steps wait on a list of their exact size, still
+// marked allocated so nothing merges with them, and a request of that size takes one back as it
+// is without searching or splitting. The parked blocks are freed and merged for real once they
+// would pass QUICK_BUDGET bytes, or when a request finds no fit without them
+#define QUICK_LISTS 8
+size_t QUICK_BUDGET = (1 << 16);
+
+// The free block at the end of the heap is the wilderness, kept off the free index so it is only
+// used when nothing else fits. A request is then cut off its start. Whenever the heap falls short,
+// the growth policy of growth.c decides how far it grows past what is missing
+
+// Requests of at least this size get a region mapped for them alone, apart from the heap, which
+// is unmapped as soon as they are freed. The region starts with the links of the registry of
+// large objects, the requested size, the context owning it and the region size, which a
+// compressed header couldn't hold, followed by a block header that only marks it allocated.
+// mm_set_large_threshold moves the size, as every large object costs a map and an unmap
+size_t LARGE_MIN_SIZE = (1 << 20);
+size_t LARGE_HEADER_SIZE = 48;
+
+// A free block at the end of the heap larger than the trim threshold is given back to the
+// system by free, all but the trim pad which stays to serve the next requests
+size_t TRIM_THRESHOLD = (1 << 20);
+size_t TRIM_PAD = (1 << 17);
+
+// Free blocks of at least this size hand the whole pages inside them back to the system, all
+// but the tree node at the start of the payload and the page of the footer. The decommitted bit
+// of their header says those pages will fault back in zeroed. Rewriting the header clears it,
+// only the free part split off a decommitted block by place keeps it, and free decommits again
+// only the pages a merge added to the ones its neighbors had decommitted
+size_t DECOMMIT_MIN_SIZE = (1 << 18);
+uint64_t DECOMMIT_BIT = 0x8;
+
+// Building with MM_SIDE_TABLE keeps a copy of every block header in a dense side table apart from
+// the heap, one 32 bit entry for each ALIGNMENT bytes of heap, at the granule the payload of the
+// block starts in and, for a free block, at its last granule for the footer. Merging, searching
+// the free index and checking the heap read sizes and allocation from the table instead of the
+// headers spread over the heap, and the previous block bits live in the table alone, so neither
+// free nor a split writes the header of the block after it. The table covers the first
+// SIDE_TABLE_GRANULES granules of the heap, blocks past that and sizes an entry can't hold, marked
+// by SIDE_SPILL, are read from their headers and footers
+#define SIDE_TABLE_GRANULES ((size_t)1 << 26)
+#define SIDE_SPILL 0xFFFFFFF0u
+
+// Building with MM_THREADS makes every call safe from any thread. The heap is sharded into up to
+// one arena per CPU, each a context with a heap instance and a lock of its own, so arenas never
+// wait on each other to allocate or to grow. A call takes the arena of the CPU it runs on, the
+// thread that ran mm_init keeps the default context, and a block always goes back to the arena
+// it came from. A block freed by a thread of another arena is pushed on a lock-free queue of its
+// arena without taking the lock, the next call holding the lock frees the whole queue at once.
+// Each thread also keeps a cache of the small blocks and slots it frees, one list per block size
+// up to TCACHE_BINS alignment steps, that serves its next requests of those sizes without any
+// lock. A cache about to hold more than TCACHE_MAX_BYTES goes back to the arenas at once, as it
+// does when its thread exits. The thread that ran mm_init has no cache while it is the only one
+// calling, as blocks held there would keep a single threaded heap from reusing them
+#define MAX_ARENAS 64
+#define TCACHE_BINS 64
+size_t TCACHE_MAX_BYTES = (1 << 16);
+
+// With background free on, free only puts what the thread cache doesn't take on a ring of the
+// calling thread, and a background thread gives the blocks of every ring back to their arenas.
+// It holds the lock of an arena for BACKGROUND_SLICE_NS at most before letting the threads of
+// the arena have it, and sleeps for BACKGROUND_IDLE_NS whenever the rings are empty
+#define FREE_RING_SIZE 4096
+long BACKGROUND_SLICE_NS = 20000;
+long BACKGROUND_IDLE_NS = 50000;
+
+// Everything one instance of the allocator keeps, so a process can host several heaps. Calls
+// work on the current context, the default one unless an mm_ctx_ entry point switched to another
+struct mm_context {
+    mem_heap_t *heap;                           // Heap the context allocates from
+    enum engine engine;                         // Engine its calls go to
+    char *heap_start;                           // Payload of the prologue block
+    char *free_lists[FL_COUNT][SL_COUNT];       // Heads of the segregated free lists or roots of the best fit trees
+    uint64_t fl_bitmap;                         // Non-empty first level classes
+    uint64_t sl_bitmap[FL_COUNT];               // Non-empty second level classes of each first level one
+    char *mini_lists[MINI_LISTS];               // Heads of the free mini lists
+    uint64_t mini_bitmap;                       // Non-empty mini lists
+    char *slab_pages[SLAB_CLASSES];             // Slab pages of each slot size that have a free slot
+    long slab_requests[SLAB_CLASSES];           // Requests each slab class has seen
+    uint64_t slab_map[SLAB_MAP_PAGES / 64];     // Heap pages that are slab pages, so a slot can be told apart from a block
+    size_t slab_map_top;                        // End of the used part of the slab page map
+    char *run_lists[RUN_CLASSES];               // Free runs by page count
+    uint64_t run_bitmap;                        // Non-empty free run lists
+    uint64_t run_map[RUN_MAP_PAGES / 64];       // First pages of runs
+    uint64_t free_run_map[RUN_MAP_PAGES / 64];  // First pages of free runs
+    size_t run_map_top;                         // End of the used part of the run page maps
+    char *wilderness;                           // Free block at the end of the heap, off the free index
+    growth_policy_t growth;                     // How far the heap grows when it falls short
+    char *quick_lists[QUICK_LISTS];             // Parked blocks of each size, linked through their first payload word
+    size_t quick_bytes;                         // Total size of the parked blocks
+    char *large_objects;                        // Registry of large objects
+    char *zeroed_lo, *zeroed_hi;                // Pages of the block calloc gets from place known to be zero
+#ifdef MM_SIDE_TABLE
+    uint32_t *side_table;                       // Copies of the headers and free block footers by granule
+#endif
+#ifdef MM_THREADS
+    pthread_mutex_t lock;                       // Held by the calls working on the context
+    char *remote_frees;                         // Blocks freed by threads of other arenas, waiting for the lock
+#endif
+};
+
+static mm_context_t default_context = {
+#ifdef MM_ENGINE_BUDDY
+    .engine = ENGINE_BUDDY,
+#else
+    .engine = ENGINE_FREELIST,
+#endif
+#ifdef MM_THREADS
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+// Each thread has a current context of its own, so threads working on separate contexts leave
+// each other's alone even without MM_THREADS
+static __thread mm_context_t *ctx = &default_context;
+
+// Bumped by every mm_init of the default context, thread caches filled before are stale
+static unsigned long tcache_generation;
+
+#ifdef MM_THREADS
+
+// Cache of freed blocks of one thread, linked through the first word of their payload
+struct tcache {
+    char *bins[TCACHE_BINS];                    // Cached blocks by block size in alignment steps
+    size_t bytes;                               // Total size of the cached blocks
+    unsigned long generation;                   // Value of tcache_generation the blocks are from
+};
+
+static __thread struct tcache tcache;
+static pthread_key_t tcache_key;
+
+// Set once a thread other than the one of mm_init calls, until then that thread has the heap to
+// itself and skips its cache, where blocks would only be kept from merging and reuse
+static bool tcache_shared;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+// Arenas by index, the default context first and the others made on first use. Only the first
+// arena_limit are used, and the thread that ran mm_init never leaves the default context
+static mm_context_t *arenas[MAX_ARENAS] = {&default_context};
+static int arena_limit = 1;
+static pthread_t arena_main;
+
+// Number of arenas mm_set_arenas forces from the next mm_init on, 0 for one per CPU. Forced
+// arenas go to threads in the order of their first call instead of by CPU
+static int arena_forced;
+static int arena_threads;
+static __thread int arena_turn = -1;
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Ring of the blocks one thread freed for the background thread, which it alone takes from.
+// Rings are never unmapped, one let go by a thread that exited goes to the next new thread
+struct free_ring {
+    char *slots[FREE_RING_SIZE];                // Freed blocks from head to tail
+    unsigned long head;                         // Next slot the background thread takes
+    unsigned long tail;                         // Next slot the thread fills
+    bool in_use;                                // Whether a thread owns the ring
+    struct free_ring *next;                     // Next ring of the registry
+};
+
+static struct free_ring *free_rings;
+static __thread struct free_ring *free_ring;
+static bool background_on, background_running;
+static pthread_t background_thread;
+static pthread_mutex_t background_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#endif /* MM_THREADS */
 
 // Returns package at given address in the heap
 uint64_t GET(char *addr) {return (*(uint64_t *)(addr));}
 
+// Returns the header or footer at given address in the heap
+uint64_t GET_TAG(char *addr) {return (*(tag_t *)(addr));}
+
 // Return size of block at given address in the heap 
-size_t GET_SIZE(char *addr) {return (GET(addr) & ~(DHEAD_SIZE - 1));}
+size_t GET_SIZE(char *addr) {return (GET_TAG(addr) & ~(DHEAD_SIZE - 1));}
+
+#ifdef MM_SIDE_TABLE
+// Returns the side table entry of the granule at given address in the heap, NULL past the table
+uint32_t *SIDE_ENTRY(char *addr)
+{
+    size_t index = (size_t)(addr - ctx->heap_start) / ALIGNMENT;
+    return (index < SIDE_TABLE_GRANULES) ? ctx->side_table + index : NULL;
+}
+
+// Returns the size an entry holds, SIDE_SPILL if the header or footer has to be read instead
+size_t SIDE_SIZE(uint32_t *entry) {return (*entry & ~(uint32_t)(DHEAD_SIZE - 1));}
+
+// Writes a header or footer into an entry, a size too large for it is left to the tag
+void PUT_SIDE(uint32_t *entry, uint64_t pack)
+{
+    size_t size = pack & ~(uint64_t)(DHEAD_SIZE - 1);
+    *entry = (size < SIDE_SPILL) ? (uint32_t)pack : (SIDE_SPILL | (uint32_t)(pack & (DHEAD_SIZE - 1)));
+    return;
+}
+#endif
 
 // Return allocation status of block at given address in the heap 
-size_t GET_ALLOC(char *addr) {return (GET(addr) & 0x1);}
+size_t GET_ALLOC(char *addr) {return (GET_TAG(addr) & 0x1);}
+
+// Returns the tag holding the previous block bits of the header at given address, its side table
+// entry where the table covers the block, as those bits are only kept up to date there
+uint64_t GET_PREV_TAG(char *addr)
+{
+#ifdef MM_SIDE_TABLE
+    uint32_t *entry = SIDE_ENTRY(addr + HEAD_SIZE);
+    if (entry != NULL) return *entry;
+#endif
+    return GET_TAG(addr);
+}
 
+// Return allocation status of the block before the one whose header is at the given address.
+// Allocated blocks have no footer, so this bit is the only way to know the previous block is in use
+size_t GET_PREV_ALLOC(char *addr) {return ((GET_PREV_TAG(addr) >> 1) & 0x1);}
+
+// Return whether the block before the one whose header is at the given address is a mini block.
+// Mini blocks have no footer either, so this bit is the only way to find the start of a free one
+size_t GET_PREV_MINI(char *addr) {return ((GET_PREV_TAG(addr) >> 2) & 0x1);}
+
+// Return whether the pages inside the free block whose header is at the given address are decommitted
+size_t GET_DECOMMITTED(char *addr) {return ((GET_TAG(addr) >> 3) & 0x1);}
+
+// Return both previous block bits of the header at given address, kept when the header is rewritten
+size_t GET_PREV(char *addr) {return (GET_PREV_TAG(addr) & 0x6);}
+
+// Returns the previous block bits for the header after a block of given size and allocation
+size_t PREV_BITS(size_t size, size_t alloc) {return (((size_t)(size == MINI_SIZE)) << 2) | (alloc << 1);}
+
+#ifdef MM_COMPRESSED
+// Free list links are offsets from the heap start, which is the prologue and never free, so 0 is NULL
+char *LINK_ADDR(uint32_t offset) {return (offset == 0) ? NULL : ctx->heap_start + offset;}
+uint32_t LINK_OFFSET(char *addr) {return (addr == NULL) ? 0 : (uint32_t)(addr - ctx->heap_start);}
+
+// Return address to the previous free list pointer stored at given address in heap
+char *GET_PREV_FREE(char *addr) {return LINK_ADDR(*(uint32_t *)addr);}
+
+// Return address to the next free list pointer stored at given address in heap
+char *GET_NEXT_FREE(char *addr) {return LINK_ADDR(*(uint32_t *)(addr + sizeof(uint32_t)));}
+#else
 // Return address to the previous free list pointer stored at given address in heap
 char *GET_PREV_FREE(char *addr) {return (char *)(GET(addr));}
 
 // Return address to the next free list pointer stored at given address in heap
-char *GET_NEXT_FREE(char *addr) {return (char *)(GET(addr + HEAD_SIZE));}
+char *GET_NEXT_FREE(char *addr) {return (char *)(GET(addr + WORD_SIZE));}
+#endif
+
+// Return address to the next mini free list pointer, the only link a free mini block holds
+char *GET_NEXT_MINI(char *addr) {return (char *)(GET(addr));}
 
 // return address to the header from given address in heap
 char *HEADER(char *addr) {return (char*)(addr) - HEAD_SIZE;}
 
-// return address to the footer from given address in heap
-char *FOOTER(char *addr) {return ((char *)(addr) + GET_SIZE(HEADER(addr)) - DHEAD_SIZE); }
+// Return size of the block at given address in the heap, from the side table where it covers the block
+size_t BLOCK_SIZE(char *addr)
+{
+#ifdef MM_SIDE_TABLE
+    uint32_t *entry = SIDE_ENTRY(addr);
+    if (entry != NULL && SIDE_SIZE(entry) != SIDE_SPILL) return SIDE_SIZE(entry);
+#endif
+    return GET_SIZE(HEADER(addr));
+}
+
+// Return allocation status of the block at given address in the heap, from the side table where it covers the block
+size_t BLOCK_ALLOC(char *addr)
+{
+#ifdef MM_SIDE_TABLE
+    uint32_t *entry = SIDE_ENTRY(addr);
+    if (entry != NULL) return (*entry & 0x1);
+#endif
+    return GET_ALLOC(HEADER(addr));
+}
+
+// return address to the footer from given address in heap, only free blocks have one
+char *FOOTER(char *addr) {return ((char *)(addr) + GET_SIZE(HEADER(addr)) - 2*HEAD_SIZE); }
 
 // return the address of the next block from given address in heap
-char *NEXT_ADDR(char *addr) {return ((char *)(addr) + GET_SIZE(((char *)(addr) - HEAD_SIZE)));}
+char *NEXT_ADDR(char *addr) {return ((char *)(addr) + BLOCK_SIZE(addr));}
+
+// return the address of the previous block from given address in heap, only valid if that block is free
+// or a mini block, which is found by the prev mini bit instead of a footer
+char *PREV_ADDR(char *addr)
+{
+    if (GET_PREV_MINI(HEADER(addr))) return (char *)(addr) - MINI_SIZE;
+#ifdef MM_SIDE_TABLE
+    uint32_t *entry = SIDE_ENTRY(addr - ALIGNMENT);
+    if (entry != NULL && SIDE_SIZE(entry) != SIDE_SPILL) return (char *)(addr) - SIDE_SIZE(entry);
+#endif
+    return ((char *)(addr) - GET_SIZE(((char *)(addr) - 2*HEAD_SIZE)));
+} 
+
+// Returns whether the heap may grow by given size, compressed tags and links only reach COMPRESSED_LIMIT
+bool HEAP_CAN_GROW(size_t size)
+{
+#ifdef MM_COMPRESSED
+    return mem_heapsize_h(ctx->heap) + size <= COMPRESSED_LIMIT;
+#else
+    return true;
+#endif
+}
+
+// Returns the first multiple of align, a power of two, from the given address
+char *ALIGN_UP(char *addr, size_t align) {return (char *)(((uint64_t)addr + align - 1) & ~(uint64_t)(align - 1));}
 
-// return the address of the previous block from given address in heap
-char *PREV_ADDR(char *addr) {return ((char *)(addr) - GET_SIZE(((char *)(addr) - DHEAD_SIZE)));} 
+// Return the first page and the end of the pages inside the free block at given address that
+// decommitting it hands back, past its tree node and before the page of its footer. Pages are
+// those of the heap, huge ones on a heap backed by them
+char *DECOMMIT_LO(char *addr) {return ALIGN_UP(addr + 4*WORD_SIZE, mem_pagesize_h(ctx->heap));}
+char *DECOMMIT_HI(char *addr) {return (char *)((uint64_t)FOOTER(addr) & ~(uint64_t)(mem_pagesize_h(ctx->heap) - 1));}
 
-// Uses bitwise operators to return a package of size and allocation ready to be placed into the heap
-uint64_t PACK(size_t size,  size_t alloc)
+// Uses bitwise operators to return a package of size, previous block bits and allocation ready to be placed into the heap
+uint64_t PACK(size_t size, size_t prev, size_t alloc)
 {
-    return ((size) | (alloc));
+    return ((size) | (prev) | (alloc));
 }
 
 // Writes pack at given address in heap
@@ -104,75 +456,450 @@ void PUT(char *addr, uint64_t pack)
     return;
 }
 
+// Writes a header or footer at given address in heap
+void PUT_TAG(char *addr, uint64_t pack)
+{
+    *(tag_t *)(addr) = (tag_t)(pack);
+    return;
+}
+
+// Writes the header of the block at given address in heap, and its side table entry
+void PUT_HEADER(char *addr, uint64_t pack)
+{
+    PUT_TAG(HEADER(addr), pack);
+#ifdef MM_SIDE_TABLE
+    uint32_t *entry = SIDE_ENTRY(addr);
+    if (entry != NULL) PUT_SIDE(entry, pack);
+#endif
+    return;
+}
+
+// Rewrites only the previous block bits of the header at given address in heap, in its side
+// table entry alone where the table covers the block
+void PUT_PREV(char *addr, size_t prev)
+{
+#ifdef MM_SIDE_TABLE
+    uint32_t *entry = SIDE_ENTRY(addr + HEAD_SIZE);
+    if (entry != NULL) {
+        *entry = (*entry & ~(uint32_t)0x6) | (uint32_t)prev;
+        return;
+    }
+#endif
+    PUT_TAG(addr, (GET_TAG(addr) & ~(uint64_t)0x6) | prev);
+    return;
+}
+
+// Writes the header of a free block at given address and its footer, mini blocks have no room for one
+void PUT_FREE_BLOCK(char *addr, size_t size, size_t prev)
+{
+    PUT_HEADER(addr, PACK(size, prev, 0));
+    if (size > MINI_SIZE) {
+        PUT_TAG(FOOTER(addr), PACK(size, prev, 0));
+#ifdef MM_SIDE_TABLE
+        uint32_t *entry = SIDE_ENTRY(addr + size - ALIGNMENT);
+        if (entry != NULL) PUT_SIDE(entry, PACK(size, prev, 0));
+#endif
+    }
+    return;
+}
+
 // Writes pointers prev and next at given address in heap
 void PUT_FREELIST(char *addr, char *prev, char *next)
 {
+#ifdef MM_COMPRESSED
+    *(uint32_t *)addr = LINK_OFFSET(prev);
+    *(uint32_t *)(addr + sizeof(uint32_t)) = LINK_OFFSET(next);
+#else
     PUT(addr, (uint64_t)prev);
-    PUT(addr + HEAD_SIZE, (uint64_t)next);
+    PUT(addr + WORD_SIZE, (uint64_t)next);
+#endif
 }
 
-// Create a new free list entry and updates the list
-void NEW_FREELIST_ENTRY(char *addr)
+// Return address of the left child stored in a large free block
+char *GET_LEFT(char *addr) {return (char *)(GET(addr));}
+
+// Return address of the right child stored in a large free block
+char *GET_RIGHT(char *addr) {return (char *)(GET(addr + WORD_SIZE));}
+
+// Return address of the parent stored in a large free block, NULL for the root
+char *GET_PARENT(char *addr) {return (char *)(GET(addr + DHEAD_SIZE));}
+
+// Return height of the subtree rooted at a large free block, an empty subtree has height 0
+long GET_HEIGHT(char *addr) {return (addr == NULL) ? 0 : (long)(GET(addr + DHEAD_SIZE + WORD_SIZE));}
+
+// Writes the left child of a tree node and points the child back at it
+void PUT_LEFT(char *addr, char *left)
 {
-    // If this is the start of the free list, set the free list lo and hi pointers
-    if (free_list_lo == heap_start) {
-        free_list_lo = addr;
-        free_list_hi = free_list_lo;
+    PUT(addr, (uint64_t)left);
+    if (left != NULL) PUT(left + DHEAD_SIZE, (uint64_t)addr);
+}
+
+// Writes the right child of a tree node and points the child back at it
+void PUT_RIGHT(char *addr, char *right)
+{
+    PUT(addr + WORD_SIZE, (uint64_t)right);
+    if (right != NULL) PUT(right + DHEAD_SIZE, (uint64_t)addr);
+}
+
+// Recomputes the height of a tree node from its children
+void PUT_HEIGHT(char *addr)
+{
+    long left_height = GET_HEIGHT(GET_LEFT(addr)), right_height = GET_HEIGHT(GET_RIGHT(addr));
+    PUT(addr + DHEAD_SIZE + WORD_SIZE, (uint64_t)(1 + (left_height > right_height ? left_height : right_height)));
+}
+
+// Tree order: smaller blocks first and the lower address first between equal sizes
+bool NODE_LESS(char *a, char *b)
+{
+    size_t a_size = BLOCK_SIZE(a), b_size = BLOCK_SIZE(b);
+    return (a_size < b_size) || (a_size == b_size && a < b);
+}
+
+// Returns the index of the most significant set bit of a nonzero value
+int MSB(uint64_t x) {return 63 - __builtin_clzll(x);}
+
+// Returns the index of the least significant set bit of a nonzero value
+int LSB(uint64_t x) {return __builtin_ctzll(x);}
+
+// Return the slab page holding the slot at given address
+char *SLAB_PAGE(char *addr) {return (char *)((uint64_t)addr & ~(uint64_t)(SLAB_PAGE_SIZE - 1));}
+
+// Return the index of the page holding the given address in the slab page map
+size_t SLAB_INDEX(char *addr) {return ((uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap)) / SLAB_PAGE_SIZE;}
+
+// Return whether the given address is a slot of a slab page rather than the payload of a block
+bool IS_SLAB(char *addr)
+{
+    size_t index = SLAB_INDEX(addr);
+    return (index < ctx->slab_map_top) && ((ctx->slab_map[index / 64] >> (index % 64)) & 1);
+}
+
+// Marks the page at given address as a slab page in the page map or clears it
+void PUT_SLAB_MAP(char *page, bool slab)
+{
+    size_t index = SLAB_INDEX(page);
+    if (slab) ctx->slab_map[index / 64] |= (1ULL << (index % 64));
+    else ctx->slab_map[index / 64] &= ~(1ULL << (index % 64));
+    if (slab && index >= ctx->slab_map_top) ctx->slab_map_top = index + 1;
+}
+
+// Return the slot size of the slab page at given address
+size_t GET_SLOT_SIZE(char *page) {return GET(page);}
+
+// Return the number of free slots of the slab page at given address
+size_t GET_FREE_SLOTS(char *page) {return GET(page + WORD_SIZE);}
+
+// Return the previous and next page in the class list of the slab page at given address
+char *GET_PREV_PAGE(char *page) {return (char *)GET(page + DHEAD_SIZE);}
+char *GET_NEXT_PAGE(char *page) {return (char *)GET(page + DHEAD_SIZE + WORD_SIZE);}
+
+// Return the address of a word of the free slot bitmap of the slab page at given address
+char *SLAB_BITMAP(char *page, int word) {return page + 2*DHEAD_SIZE + word*WORD_SIZE;}
+
+// Return the number of slots in a slab page of given slot size
+size_t SLAB_SLOTS(size_t slot_size) {return (SLAB_BLOCK_SIZE - HEAD_SIZE - SLAB_HEADER_SIZE) / slot_size;}
+
+// Return whether the given address starts a run, or a free run, in the given run page map
+bool IN_RUN_MAP(uint64_t *map, char *addr)
+{
+    size_t index = ((uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap)) / RUN_PAGE_SIZE;
+    return ((uint64_t)addr % RUN_PAGE_SIZE == 0) && (index < ctx->run_map_top) && ((map[index / 64] >> (index % 64)) & 1);
+}
+
+// Marks the run starting at given address in the given run page map or clears it
+void PUT_RUN_MAP(uint64_t *map, char *addr, bool set)
+{
+    size_t index = ((uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap)) / RUN_PAGE_SIZE;
+    if (set) map[index / 64] |= (1ULL << (index % 64));
+    else map[index / 64] &= ~(1ULL << (index % 64));
+    if (set && index >= ctx->run_map_top) ctx->run_map_top = index + 1;
+}
+
+// Return whether the given address is the payload of a run, and of a free run
+bool IS_RUN(char *addr) {return IN_RUN_MAP(ctx->run_map, addr);}
+bool IS_FREE_RUN(char *addr) {return IN_RUN_MAP(ctx->free_run_map, addr);}
+
+// Returns the size of the run holding a payload of given size, in whole run pages
+size_t RUN_SIZE(size_t size) {return RUN_PAGE_SIZE * ((size + HEAD_SIZE + RUN_PAGE_SIZE - 1) / RUN_PAGE_SIZE);}
+
+// Returns the list of free runs of given size
+int RUN_CLASS(size_t size)
+{
+    size_t pages = size / RUN_PAGE_SIZE;
+    return (pages < RUN_CLASSES) ? (int)pages - 1 : RUN_CLASSES - 1;
+}
+
+// Returns whether the given payload lies outside the heap, in a region of its own
+bool IS_LARGE(char *addr) {return addr < (char *)mem_heap_lo_h(ctx->heap) || addr > (char *)mem_heap_hi_h(ctx->heap);}
+
+// Returns the size of the region of whole pages that holds a large request of given size
+size_t LARGE_REGION_SIZE(size_t size) {return (size + LARGE_HEADER_SIZE + mem_pagesize() - 1) / mem_pagesize() * mem_pagesize();}
+
+// Return and write the registry links and requested size at the start of a large object region
+char *GET_PREV_LARGE(char *addr) {return *(char **)(addr - LARGE_HEADER_SIZE);}
+char *GET_NEXT_LARGE(char *addr) {return *(char **)(addr - LARGE_HEADER_SIZE + WORD_SIZE);}
+size_t GET_LARGE_REQUEST(char *addr) {return GET(addr - LARGE_HEADER_SIZE + DHEAD_SIZE);}
+mm_context_t *GET_LARGE_CONTEXT(char *addr) {return *(mm_context_t **)(addr - LARGE_HEADER_SIZE + DHEAD_SIZE + WORD_SIZE);}
+size_t GET_LARGE_SIZE(char *addr) {return GET(addr - LARGE_HEADER_SIZE + 2*DHEAD_SIZE);}
+void PUT_PREV_LARGE(char *addr, char *prev) {*(char **)(addr - LARGE_HEADER_SIZE) = prev;}
+void PUT_NEXT_LARGE(char *addr, char *next) {*(char **)(addr - LARGE_HEADER_SIZE + WORD_SIZE) = next;}
+
+// Returns which of the mini lists holds the free mini block at given address
+int MINI_LIST(char *addr) {return (int)(((uint64_t)addr / MINI_SIZE) % MINI_LISTS);}
+
+// Maps a block size to the first and second level index of the list holding it
+void MAPPING_INSERT(size_t size, int *fl, int *sl)
+{
+    // Small sizes get one list per alignment step in the first class
+    if (size < SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = (int)(size / ALIGNMENT);
+    }
+    else {
+        int msb = MSB(size);
+        *sl = (int)(size >> (msb - SL_LOG)) ^ SL_COUNT;
+        *fl = msb - FL_SHIFT + 1;
+    }
+}
+
+// Maps a request size to the first list whose every block is large enough for it
+void MAPPING_SEARCH(size_t size, int *fl, int *sl)
+{
+    if (size >= SMALL_BLOCK_SIZE) size += ((size_t)1 << (MSB(size) - SL_LOG)) - 1;
+    MAPPING_INSERT(size, fl, sl);
+}
+
+// Makes new take the place of old under old's parent, or as the root of their class tree
+static void replace_child(char *parent, char *old, char *new)
+{
+    if (parent == NULL) {
+        int fl, sl;
+        MAPPING_INSERT(BLOCK_SIZE((old != NULL) ? old : new), &fl, &sl);
+
+        ctx->free_lists[fl][sl] = new;
+        if (new != NULL) PUT(new + DHEAD_SIZE, (uint64_t)NULL);
     }
+    else if (GET_LEFT(parent) == old) PUT_LEFT(parent, new);
+    else PUT_RIGHT(parent, new);
+}
+
+// Rotates the subtree at the given node to the right and returns the new subtree root
+static char *rotate_right(char *node)
+{
+    char *left = GET_LEFT(node);
+
+    replace_child(GET_PARENT(node), node, left);
+    PUT_LEFT(node, GET_RIGHT(left));
+    PUT_RIGHT(left, node);
+    PUT_HEIGHT(node);
+    PUT_HEIGHT(left);
+    return left;
+}
 
-    PUT_FREELIST(addr, free_list_hi, free_list_lo);
+// Rotates the subtree at the given node to the left and returns the new subtree root
+static char *rotate_left(char *node)
+{
+    char *right = GET_RIGHT(node);
+
+    replace_child(GET_PARENT(node), node, right);
+    PUT_RIGHT(node, GET_LEFT(right));
+    PUT_LEFT(right, node);
+    PUT_HEIGHT(node);
+    PUT_HEIGHT(right);
+    return right;
+}
 
-    // Update existing entries and free list hi index if free list exists
-    if (free_list_lo != heap_start) {
+// Restores the AVL height condition at the given node and returns the new subtree root
+static char *rebalance(char *node)
+{
+    long balance = GET_HEIGHT(GET_LEFT(node)) - GET_HEIGHT(GET_RIGHT(node));
 
-        // There is only one entry in the free list that needs updated
-        if (free_list_hi == free_list_lo) PUT_FREELIST(free_list_hi, addr, addr);
-        
-        // Previous and next entries of the free list need to point to the newly created entry
-        else {
-            PUT_FREELIST(free_list_hi, GET_PREV_FREE(free_list_hi), addr);
-            PUT_FREELIST(free_list_lo, addr, GET_NEXT_FREE(free_list_lo));
+    // Left heavy, rotate the left child first if it leans the other way
+    if (balance > 1) {
+        char *left = GET_LEFT(node);
+        if (GET_HEIGHT(GET_LEFT(left)) < GET_HEIGHT(GET_RIGHT(left))) rotate_left(left);
+        return rotate_right(node);
+    }
+
+    // Right heavy, rotate the right child first if it leans the other way
+    if (balance < -1) {
+        char *right = GET_RIGHT(node);
+        if (GET_HEIGHT(GET_RIGHT(right)) < GET_HEIGHT(GET_LEFT(right))) rotate_right(right);
+        return rotate_left(node);
+    }
+
+    return node;
+}
+
+// Walks from a node whose subtree changed up to the root fixing heights and balance,
+// stopping as soon as a subtree ends up with the height it had before
+static void retrace(char *node)
+{
+    while (node != NULL) {
+        long old_height = GET_HEIGHT(node);
+
+        PUT_HEIGHT(node);
+        node = rebalance(node);
+
+        if (GET_HEIGHT(node) == old_height) return;
+        node = GET_PARENT(node);
+    }
+}
+
+// Inserts a free block as a leaf of the given class tree and rebalances above it
+static void free_tree_insert(char *root, char *addr)
+{
+    char *parent = NULL, *node = root;
+    bool left = false;
+
+    // Find the leaf position of the block in size then address order
+    while (node != NULL) {
+        parent = node;
+        left = NODE_LESS(addr, node);
+        node = left ? GET_LEFT(node) : GET_RIGHT(node);
+    }
+
+    PUT_LEFT(addr, NULL);
+    PUT_RIGHT(addr, NULL);
+    PUT_HEIGHT(addr);
+
+    if (parent == NULL) replace_child(NULL, NULL, addr);
+    else if (left) PUT_LEFT(parent, addr);
+    else PUT_RIGHT(parent, addr);
+
+    retrace(parent);
+}
+
+// Removes a free block from the best fit tree using its parent link, no search needed
+static void free_tree_remove(char *addr)
+{
+    char *left = GET_LEFT(addr), *right = GET_RIGHT(addr), *parent = GET_PARENT(addr);
+
+    // At most one child, which simply takes the place of the block
+    if (left == NULL || right == NULL) {
+        replace_child(parent, addr, (left != NULL) ? left : right);
+        retrace(parent);
+        return;
+    }
+
+    // Two children, the in-order successor is unlinked and takes the place of the block
+    char *succ = right, *changed;
+    while (GET_LEFT(succ) != NULL) succ = GET_LEFT(succ);
+
+    if (succ == right) changed = succ;
+    else {
+        changed = GET_PARENT(succ);
+        PUT_LEFT(changed, GET_RIGHT(succ));
+        PUT_RIGHT(succ, right);
+    }
+    PUT_LEFT(succ, left);
+    replace_child(parent, addr, succ);
+    PUT(succ + DHEAD_SIZE + WORD_SIZE, GET(addr + DHEAD_SIZE + WORD_SIZE));
+
+    retrace(changed);
+}
+
+// Returns the smallest free block of a class tree of at least the given size, lowest address among ties
+static char *free_tree_best_fit(char *root, size_t size)
+{
+    char *fit = NULL;
+
+    for (char *node = root; node != NULL; ) {
+        if (BLOCK_SIZE(node) >= size) {
+            fit = node;
+            node = GET_LEFT(node);
         }
+        else node = GET_RIGHT(node);
+    }
+    return fit;
+}
+
+// Create a new free list entry at the head of its size class and updates the bitmaps,
+// large blocks go into the best fit tree of their class instead and mini blocks only get
+// a next link. The last block of the heap becomes the wilderness
+void NEW_FREELIST_ENTRY(char *addr)
+{
+    int fl, sl;
 
-        free_list_hi = addr; 
+    // A free block followed by the buffer header is the wilderness instead
+    if (BLOCK_SIZE(NEXT_ADDR(addr)) == 0) {
+        ctx->wilderness = addr;
+        return;
     }
+
+    MAPPING_INSERT(BLOCK_SIZE(addr), &fl, &sl);
+
+    char *head = ctx->free_lists[fl][sl];
+
+    if (BLOCK_SIZE(addr) >= TREE_MIN_SIZE) free_tree_insert(head, addr);
+    else if (BLOCK_SIZE(addr) == MINI_SIZE) {
+        int list = MINI_LIST(addr);
+        PUT(addr, (uint64_t)ctx->mini_lists[list]);
+        ctx->mini_lists[list] = addr;
+        ctx->mini_bitmap |= (1ULL << list);
+        ctx->free_lists[fl][sl] = ctx->mini_lists[LSB(ctx->mini_bitmap)];
+    }
+    else {
+        PUT_FREELIST(addr, NULL, head);
+        if (head != NULL) PUT_FREELIST(head, addr, GET_NEXT_FREE(head));
+        ctx->free_lists[fl][sl] = addr;
+    }
+
+    ctx->fl_bitmap |= (1ULL << fl);
+    ctx->sl_bitmap[fl] |= (1ULL << sl);
     return;
 }
 
-// Removes free list entry from the given address in heap and updates the free list
+// Removes free list entry from the given address in heap and updates the bitmaps,
+// large blocks are removed from the best fit tree of their class instead and the
+// wilderness is only forgotten
 void REMOVE_FREELIST(char *addr)
 {
-    // The freelist is empty, this function shouldn't have been called
-    if (free_list_lo == heap_start) mm_checkheap(__LINE__);
-
-    // There is only one entry in the free list
-    else if (free_list_lo == free_list_hi) {
+    int fl, sl;
 
-        // Set index back to heap start
-        free_list_lo = heap_start;
-        free_list_hi = free_list_lo;
+    if (addr == ctx->wilderness) {
+        ctx->wilderness = NULL;
+        return;
     }
 
-    // There are only two elements in the free list
-    else if (addr == GET_PREV_FREE(GET_PREV_FREE(addr))) {
+    MAPPING_INSERT(BLOCK_SIZE(addr), &fl, &sl);
 
-        // Only one entry remains so make it point to itself and update index
-        char *prev = GET_PREV_FREE(addr);
-        PUT_FREELIST(prev, prev, prev);
-        free_list_lo = prev;
-        free_list_hi = free_list_lo;
-    }
+    if (BLOCK_SIZE(addr) >= TREE_MIN_SIZE) free_tree_remove(addr);
+    else if (BLOCK_SIZE(addr) == MINI_SIZE) {
+        int list = MINI_LIST(addr);
+        char *next = GET_NEXT_MINI(addr);
+
+        // The mini list has no back links, so the entry before this one is searched for
+        if (ctx->mini_lists[list] != addr) {
+            char *prev = ctx->mini_lists[list];
+            while (GET_NEXT_MINI(prev) != addr) prev = GET_NEXT_MINI(prev);
+            PUT(prev, (uint64_t)next);
+            return;
+        }
 
-    // General case for more than two elements in the free list
+        ctx->mini_lists[list] = next;
+        if (next == NULL) ctx->mini_bitmap &= ~(1ULL << list);
+        ctx->free_lists[fl][sl] = (ctx->mini_bitmap == 0) ? NULL : ctx->mini_lists[LSB(ctx->mini_bitmap)];
+    }
     else {
+        char *prev = GET_PREV_FREE(addr);
+        char *next = GET_NEXT_FREE(addr);
 
-        // Make the previous point to the next and vice versa
-        PUT_FREELIST(GET_PREV_FREE(addr), GET_PREV_FREE(GET_PREV_FREE(addr)), GET_NEXT_FREE(addr));
-        PUT_FREELIST(GET_NEXT_FREE(addr), GET_PREV_FREE(addr), GET_NEXT_FREE(GET_NEXT_FREE(addr)));
-        
-        // Update the corresponding index if the removed entry was at an index
-        if (addr == free_list_hi) free_list_hi = GET_PREV_FREE(addr);
-        if (addr == free_list_lo) free_list_lo = GET_NEXT_FREE(addr); 
+        // Unlink the entry from its neighbors
+        if (next != NULL) PUT_FREELIST(next, prev, GET_NEXT_FREE(next));
+        if (prev != NULL) {
+            PUT_FREELIST(prev, GET_PREV_FREE(prev), next);
+            return;
+        }
+
+        // The entry was the head of its list so the head changes
+        ctx->free_lists[fl][sl] = next;
+    }
+
+    // Clear the bitmaps if the class became empty
+    if (ctx->free_lists[fl][sl] == NULL) {
+        ctx->sl_bitmap[fl] &= ~(1ULL << sl);
+        if (ctx->sl_bitmap[fl] == 0) ctx->fl_bitmap &= ~(1ULL << fl);
     }
     return;
 }
@@ -183,159 +910,1561 @@ static size_t align(size_t x)
     return ALIGNMENT * ((x+ALIGNMENT-1)/ALIGNMENT);
 }
 
-// First fit algorithm to find the first available space in the heap using the free list for the given size
+// Returns the block size needed for a payload, the header plus the payload rounded up to
+// the alignment. Payloads of up to one word fit a mini block
+static size_t block_size(size_t size)
+{
+    return align(size + HEAD_SIZE);
+}
+
+// Searches the free index for the given size. Large sizes take the best fit from the
+// tree of their own class. Small sizes try a few entries of the exact size class and
+// then round up so any block of the class fits. Either way the first non-empty class
+// after that is found with the bitmaps in constant time
 void *find_fit(size_t size)
 {
-    // No free blocks in heap, return early to save time
-    if (free_list_lo == heap_start) return NULL;
+    int fl, sl, probes = 0;
+    char *addr;
+
+    MAPPING_INSERT(size, &fl, &sl);
 
-    char *addr = free_list_lo;
+    if (size >= TREE_MIN_SIZE) {
+        if ((addr = free_tree_best_fit(ctx->free_lists[fl][sl], size)) != NULL) return addr;
+        sl += 1;
+    }
+    else {
+        // Probe the head of the class the size itself maps to for a block that fits
+        for (addr = ctx->free_lists[fl][sl]; addr != NULL && probes < FIT_PROBES; addr = GET_NEXT_FREE(addr), probes++)
+            if (size <= BLOCK_SIZE(addr)) return addr;
 
-    // Loop through the free list and return the address of the first block that fits the given size
-    do if (!GET_ALLOC(HEADER(addr)) && (size <= GET_SIZE(HEADER(addr)))) return addr;
-    while ((addr = GET_NEXT_FREE(addr)) != free_list_lo);
+        // Round the size up so any block in the found class fits
+        MAPPING_SEARCH(size, &fl, &sl);
+    }
 
-    return NULL;
+    // Look for a non-empty class in the same first level class, then in any larger one
+    uint64_t sl_map = ctx->sl_bitmap[fl] & (~0ULL << sl);
+    if (sl_map == 0) {
+        uint64_t fl_map = ctx->fl_bitmap & (~0ULL << (fl + 1));
+        if (fl_map == 0) return NULL;
+        fl = LSB(fl_map);
+        sl_map = ctx->sl_bitmap[fl];
+    }
+    sl = LSB(sl_map);
+
+    // Every block of the class fits, a tree gives its smallest one
+    addr = ctx->free_lists[fl][sl];
+    if (BLOCK_SIZE(addr) >= TREE_MIN_SIZE) addr = free_tree_best_fit(addr, 0);
+
+    return addr;
 }
 
-// Places a header and footer into the heap at a given address and split blocks if necessary
+// Marks the size bytes at a given address, already off the free index, as an allocated block
+// of new size and splits the rest off as a free block if it is large enough. Allocated blocks
+// carry no footer, the block after them records their state in its prev alloc bit
+void allocate_block(char *addr, size_t size, size_t new_size)
+{
+    size_t prev = GET_PREV(HEADER(addr));
+
+    // Splitting is necessary
+    if ((size - new_size) >= MINI_SIZE) 
+    {
+
+        // Place new allocated header in heap
+        PUT_HEADER(addr, PACK(new_size, prev, 1));
+
+        addr = NEXT_ADDR(addr);
+
+        // Place new free header and footer in heap and tell the block after it
+        PUT_FREE_BLOCK(addr, size-new_size, PREV_BITS(new_size, 1));
+        PUT_PREV(HEADER(NEXT_ADDR(addr)), PREV_BITS(size-new_size, 0));
+
+        // Create new free list entry
+        NEW_FREELIST_ENTRY(addr);
+    }
+
+    // Splitting is not necessary
+    else
+    {
+        // Place new allocated header in heap and tell the next block
+        PUT_HEADER(addr, PACK(size, prev, 1));
+        PUT_PREV(HEADER(NEXT_ADDR(addr)), PREV_BITS(size, 1));
+    }
+}
+
+// Places an allocated block of new size into the free block at a given address. The pages of a
+// decommitted block are zero until written, calloc is told which and the free part split off keeps
+// the decommitted bit since its own inside pages lie within them
 void place(char *addr, size_t new_size)
 {
-    size_t old_size = GET_SIZE(HEADER(addr));
+    size_t decommitted = GET_DECOMMITTED(HEADER(addr));
+
+    ctx->zeroed_lo = decommitted ? DECOMMIT_LO(addr) : NULL;
+    ctx->zeroed_hi = decommitted ? DECOMMIT_HI(addr) : NULL;
 
     // Remove free list entry
     REMOVE_FREELIST(addr);
 
-    // Splitting is necessary
-    if ((old_size - new_size) >= (2*DHEAD_SIZE)) 
-    {
+    allocate_block(addr, GET_SIZE(HEADER(addr)), new_size);
+
+    char *rest = NEXT_ADDR(addr);
+    if (decommitted && !GET_ALLOC(HEADER(rest))) PUT_TAG(HEADER(rest), GET_TAG(HEADER(rest)) | DECOMMIT_BIT);
+}
+
+// Checks if coalescing is needed at every possible case and performs it if so. The previous
+// block is only looked at once the prev alloc bit says it is free, through its footer or the
+// prev mini bit
+char *coalesce(char *addr)
+{
+    size_t prev = GET_PREV_ALLOC(HEADER(addr));
+    size_t next = BLOCK_ALLOC(NEXT_ADDR(addr));
+    size_t size = BLOCK_SIZE(addr);
+
+    // CASE 1: No coalescing needed
+    if (prev && next) {
+        return addr;
+    }
+
+    // CASE 2: Coalesce the next block
+    else if (prev && !next) {
+
+        // Remove free list entry of next block
+        REMOVE_FREELIST(NEXT_ADDR(addr));
+
+        // New size
+        size += BLOCK_SIZE(NEXT_ADDR(addr));
+    }
+
+    // CASE 3: Coalesce the previous block
+    else if (!prev && next) {
+
+        // Remove free list entry of previous block
+        REMOVE_FREELIST(PREV_ADDR(addr));
+
+        // New size and return address
+        size += BLOCK_SIZE(PREV_ADDR(addr));
+        addr = PREV_ADDR(addr);
+    }
+ 
+    // CASE 4: Coalesce both blocks
+    else { 
+
+        // Remove free list entry of previous and next block
+        REMOVE_FREELIST(PREV_ADDR(addr));
+        REMOVE_FREELIST(NEXT_ADDR(addr));
+
+        // New size and return address
+        size += BLOCK_SIZE(PREV_ADDR(addr)) + BLOCK_SIZE(NEXT_ADDR(addr));
+        addr = PREV_ADDR(addr);
+    }
+
+    // Rewrite header and footer with new size, the merged block is never a mini block
+    // so the block after it is told as well
+    PUT_FREE_BLOCK(addr, size, GET_PREV(HEADER(addr)));
+    PUT_PREV(HEADER(NEXT_ADDR(addr)), PREV_BITS(size, 0));
+
+    return addr;
+}
+
+// Extends the heap of given size, checks for coalescing, and creates new free list entry
+char *extend_heap(size_t size)
+{
+    char *addr;
+
+    // Request space of given size
+    if (!HEAP_CAN_GROW(size) || (long)(addr = mem_sbrk_h(ctx->heap, size)) == -1) return NULL;
+
+    // Initialize free block header/footer over the old buffer header and write the new buffer header
+    PUT_FREE_BLOCK(addr, size, GET_PREV(HEADER(addr)));
+    PUT_HEADER(NEXT_ADDR(addr), PACK(0, PREV_BITS(size, 0), 1)); 
+
+    char *new_addr = coalesce(addr);
+
+    NEW_FREELIST_ENTRY(new_addr);
+
+    return new_addr;
+ }
+
+// Returns the size of the wilderness, 0 if there is none
+size_t WILDERNESS_SIZE(void)
+{
+    return (ctx->wilderness == NULL) ? 0 : BLOCK_SIZE(ctx->wilderness);
+}
+
+// Extends the heap by what it is short of, or by a chunk of the growth policy if that is more.
+// The policy only records the growth once the heap did grow
+static char *grow_heap(size_t shortfall)
+{
+    size_t size = growth_extension(&ctx->growth, shortfall);
+    char *addr = extend_heap(size);
+
+    if (addr != NULL) growth_record(&ctx->growth, shortfall, size);
+    return addr;
+}
+
+// Cuts an allocated block of given size off the start of the wilderness, which first grows by
+// what it is short of, or by a chunk of the growth policy if that is more. The rest stays the
+// wilderness, so no free list is touched
+static char *wilderness_take(size_t size)
+{
+    size_t have = WILDERNESS_SIZE();
+
+    if (have < size && grow_heap(size - have) == NULL) return NULL;
+
+    char *addr = ctx->wilderness;
+    place(addr, size);
+    return addr;
+}
+
+// Hands the inside pages of the free block at given address back, all but the ranges of the free
+// neighbors it absorbed whose pages were decommitted already, given in address order. Returns
+// whether all of them are decommitted now
+static bool decommit_rest(char *addr, char *done_lo[2], char *done_hi[2])
+{
+    char *lo = DECOMMIT_LO(addr);
+    bool decommitted = true;
+
+    for (int i = 0; i < 2; i++) {
+        if (done_lo[i] == NULL) continue;
+        if (lo < done_lo[i]) decommitted &= mem_decommit_h(ctx->heap, lo, done_lo[i] - lo);
+        lo = done_hi[i];
+    }
+    if (lo < DECOMMIT_HI(addr)) decommitted &= mem_decommit_h(ctx->heap, lo, DECOMMIT_HI(addr) - lo);
+
+    return decommitted;
+}
+
+// Gives the block at given address back to the free index, merging it with free neighbors
+void free_block(char *ptr)
+{
+    size_t size = BLOCK_SIZE(ptr);
+
+    // Inside pages of free neighbors that are decommitted already stay so once merged, merging
+    // clears the bit so they are noted first
+    char *prev = GET_PREV_ALLOC(HEADER(ptr)) ? NULL : PREV_ADDR(ptr);
+    char *next = BLOCK_ALLOC(NEXT_ADDR(ptr)) ? NULL : NEXT_ADDR(ptr);
+    char *done_lo[2] = {NULL, NULL}, *done_hi[2] = {NULL, NULL};
+    if (prev != NULL && GET_DECOMMITTED(HEADER(prev)) && DECOMMIT_LO(prev) < DECOMMIT_HI(prev)) {
+        done_lo[0] = DECOMMIT_LO(prev);
+        done_hi[0] = DECOMMIT_HI(prev);
+    }
+    if (next != NULL && GET_DECOMMITTED(HEADER(next)) && DECOMMIT_LO(next) < DECOMMIT_HI(next)) {
+        done_lo[1] = DECOMMIT_LO(next);
+        done_hi[1] = DECOMMIT_HI(next);
+    }
+
+    // Put a header and footer at the given address and tell the next block
+    PUT_FREE_BLOCK(ptr, size, GET_PREV(HEADER(ptr)));
+    PUT_PREV(HEADER(NEXT_ADDR(ptr)), PREV_BITS(size, 0));
+
+    // Check if coalecsing is necessary
+    char *addr = coalesce(ptr);
+
+    // Hand the pages inside a large free block back, only those not decommitted before
+    size = GET_SIZE(HEADER(addr));
+    if (size >= DECOMMIT_MIN_SIZE && decommit_rest(addr, done_lo, done_hi))
+        PUT_TAG(HEADER(addr), GET_TAG(HEADER(addr)) | DECOMMIT_BIT);
+
+    NEW_FREELIST_ENTRY(addr);
+}
+
+// Links a slab page that has free slots at the head of the page list of its class
+static void slab_link(char *page, int class)
+{
+    char *head = ctx->slab_pages[class];
+
+    PUT(page + DHEAD_SIZE, (uint64_t)NULL);
+    PUT(page + DHEAD_SIZE + WORD_SIZE, (uint64_t)head);
+    if (head != NULL) PUT(head + DHEAD_SIZE, (uint64_t)page);
+    ctx->slab_pages[class] = page;
+}
+
+// Unlinks a slab page from the page list of its class
+static void slab_unlink(char *page, int class)
+{
+    char *prev = GET_PREV_PAGE(page), *next = GET_NEXT_PAGE(page);
+
+    if (next != NULL) PUT(next + DHEAD_SIZE, (uint64_t)prev);
+    if (prev != NULL) PUT(prev + DHEAD_SIZE + WORD_SIZE, (uint64_t)next);
+    else ctx->slab_pages[class] = next;
+}
+
+// Puts a free run on the list of its page count and marks it free in the page map. Its size
+// is also kept in its last word so the run after it can find where it starts
+static void run_insert(char *run)
+{
+    size_t size = GET_SIZE(HEADER(run));
+    int class = RUN_CLASS(size);
+    char *head = ctx->run_lists[class];
+
+    PUT_FREELIST(run, NULL, head);
+    if (head != NULL) PUT_FREELIST(head, run, GET_NEXT_FREE(head));
+    ctx->run_lists[class] = run;
+    ctx->run_bitmap |= (1ULL << class);
+
+    PUT_TAG(FOOTER(run), size);
+    PUT_RUN_MAP(ctx->free_run_map, run, true);
+}
+
+// Takes a free run off the list of its page count and clears its free mark
+static void run_remove(char *run)
+{
+    int class = RUN_CLASS(GET_SIZE(HEADER(run)));
+    char *prev = GET_PREV_FREE(run), *next = GET_NEXT_FREE(run);
+
+    if (next != NULL) PUT_FREELIST(next, prev, GET_NEXT_FREE(next));
+    if (prev != NULL) PUT_FREELIST(prev, GET_PREV_FREE(prev), next);
+    else ctx->run_lists[class] = next;
+
+    if (ctx->run_lists[class] == NULL) ctx->run_bitmap &= ~(1ULL << class);
+    PUT_RUN_MAP(ctx->free_run_map, run, false);
+}
+
+// Gives every free run back to the heap as a free block, returns whether there was any
+static bool run_release_all(void)
+{
+    if (ctx->run_bitmap == 0) return false;
+
+    for (int class = 0; class < RUN_CLASSES; class++) {
+        while (ctx->run_lists[class] != NULL) {
+            char *run = ctx->run_lists[class];
+            run_remove(run);
+            PUT_RUN_MAP(ctx->run_map, run, false);
+            free_block(run);
+        }
+    }
+    return true;
+}
+
+// Frees every parked block for real, merging it with its free neighbors. Returns whether there was any
+static bool quick_release_all(void)
+{
+    if (ctx->quick_bytes == 0) return false;
+
+    for (int list = 0; list < QUICK_LISTS; list++) {
+        while (ctx->quick_lists[list] != NULL) {
+            char *ptr = ctx->quick_lists[list];
+            ctx->quick_lists[list] = (char *)GET(ptr);
+            free_block(ptr);
+        }
+    }
+    ctx->quick_bytes = 0;
+    return true;
+}
+
+// Parks a freed block on the list of its size, returns false if it is too large for one
+static bool quick_put(char *ptr)
+{
+    size_t size = GET_SIZE(HEADER(ptr));
+    if (size > QUICK_LISTS * ALIGNMENT) return false;
+
+    if (ctx->quick_bytes + size > QUICK_BUDGET) quick_release_all();
+
+    int list = size / ALIGNMENT - 1;
+    PUT(ptr, (uint64_t)ctx->quick_lists[list]);
+    ctx->quick_lists[list] = ptr;
+    ctx->quick_bytes += size;
+    return true;
+}
+
+// Takes back a parked block of given block size, returns NULL if there is none
+static char *quick_get(size_t size)
+{
+    if (size > QUICK_LISTS * ALIGNMENT) return NULL;
+
+    int list = size / ALIGNMENT - 1;
+    char *ptr = ctx->quick_lists[list];
+    if (ptr == NULL) return NULL;
+
+    ctx->quick_lists[list] = (char *)GET(ptr);
+    ctx->quick_bytes -= size;
+    return ptr;
+}
+
+// Returns whether the free block at given address holds a block of given size whose payload
+// starts at the next multiple of align
+bool ALIGNED_FITS(char *addr, size_t size, size_t align)
+{
+    return ALIGN_UP(addr, align) + size <= addr + GET_SIZE(HEADER(addr));
+}
+
+// Carves an allocated block of given size whose payload starts on a multiple of align out of
+// the heap, the parts of the free block around it stay free blocks. A free block of just that
+// size is tried first, then one large enough wherever the boundary falls, then the wilderness
+// as it is. Otherwise the parked blocks and the free runs go back to the heap and, if that doesn't
+// help, the heap grows by what the next boundary after the last block needs, or a chunk if that is more
+static char *carve_aligned(size_t size, size_t align)
+{
+    char *addr = find_fit(size);
+    bool tail_fits = ctx->wilderness != NULL && ALIGNED_FITS(ctx->wilderness, size, align);
+
+    if (addr == NULL || !ALIGNED_FITS(addr, size, align)) addr = find_fit(size + align - ALIGNMENT);
+    if (addr == NULL && !tail_fits && quick_release_all()) addr = find_fit(size + align - ALIGNMENT);
+    if (addr == NULL && !tail_fits && run_release_all()) addr = find_fit(size + align - ALIGNMENT);
+    if (addr == NULL) {
+        char *end = (char *)mem_heap_hi_h(ctx->heap) + 1;
+        char *last = GET_PREV_ALLOC(HEADER(end)) ? end : PREV_ADDR(end);
+        char *boundary = ALIGN_UP(last, align);
+
+        if (boundary + size > end && grow_heap(boundary + size - end) == NULL) return NULL;
+        addr = last;
+    }
+    REMOVE_FREELIST(addr);
+
+    // Split the part before the boundary off as a free block of its own
+    size_t free_size = GET_SIZE(HEADER(addr));
+    char *boundary = ALIGN_UP(addr, align);
+    if (boundary != addr) {
+        size_t gap = boundary - addr;
+        PUT_FREE_BLOCK(addr, gap, GET_PREV(HEADER(addr)));
+        PUT_HEADER(boundary, PACK(free_size - gap, PREV_BITS(gap, 0), 0));
+        NEW_FREELIST_ENTRY(addr);
+        free_size -= gap;
+    }
+    allocate_block(boundary, free_size, size);
+
+    return boundary;
+}
+
+// Carves a slab page for the given class out of the heap. A free block of a page is tried
+// first since a released slab page is one
+static char *slab_new_page(int class)
+{
+    char *page = carve_aligned(SLAB_BLOCK_SIZE, SLAB_PAGE_SIZE);
+    if (page == NULL) return NULL;
+
+    // A page past the end of the page map couldn't be told apart from a block
+    if (SLAB_INDEX(page) >= SLAB_MAP_PAGES) {
+        free_block(page);
+        return NULL;
+    }
+
+    // Every slot starts out free, the bitmap bits past the last slot stay clear
+    size_t slot_size = (class + 1) * ALIGNMENT, slots = SLAB_SLOTS(slot_size);
+    PUT(page, slot_size);
+    PUT(page + WORD_SIZE, slots);
+    for (int word = 0; word < SLAB_BITMAP_WORDS; word++) {
+        size_t bits = (slots > (size_t)word * 64) ? slots - word * 64 : 0;
+        PUT(SLAB_BITMAP(page, word), (bits >= 64) ? ~0ULL : (1ULL << bits) - 1);
+    }
+
+    PUT_SLAB_MAP(page, true);
+    slab_link(page, class);
+    return page;
+}
+
+// Takes the lowest free slot of the first page of the class, NULL if no page of the class has
+// one. A page with no free slot left drops off its class list
+static void *slab_malloc(int class)
+{
+    char *page = ctx->slab_pages[class];
+    if (page == NULL) return NULL;
+
+    int word = 0;
+    while (GET(SLAB_BITMAP(page, word)) == 0) word++;
+
+    uint64_t bits = GET(SLAB_BITMAP(page, word));
+    size_t slot = word * 64 + LSB(bits);
+    PUT(SLAB_BITMAP(page, word), bits & (bits - 1));
+    PUT(page + WORD_SIZE, GET_FREE_SLOTS(page) - 1);
+
+    if (GET_FREE_SLOTS(page) == 0) slab_unlink(page, class);
+
+    return page + SLAB_HEADER_SIZE + slot * GET_SLOT_SIZE(page);
+}
+
+// Marks the slot at given address free. A full page goes back on its class list and a page
+// with no slot in use goes back to the heap as a free block
+static void slab_free(char *ptr)
+{
+    char *page = SLAB_PAGE(ptr);
+    size_t slot_size = GET_SLOT_SIZE(page);
+    size_t slot = (ptr - page - SLAB_HEADER_SIZE) / slot_size;
+    int class = slot_size / ALIGNMENT - 1;
+
+    PUT(SLAB_BITMAP(page, slot / 64), GET(SLAB_BITMAP(page, slot / 64)) | (1ULL << (slot % 64)));
+    PUT(page + WORD_SIZE, GET_FREE_SLOTS(page) + 1);
+
+    if (GET_FREE_SLOTS(page) == 1) slab_link(page, class);
+    if (GET_FREE_SLOTS(page) == SLAB_SLOTS(slot_size)) {
+        slab_unlink(page, class);
+        PUT_SLAB_MAP(page, false);
+        free_block(page);
+    }
+}
+
+// Splits the pages of a run past the given size off as a free run of their own
+static void run_split(char *run, size_t size)
+{
+    size_t rest = GET_SIZE(HEADER(run)) - size;
+    if (rest == 0) return;
+
+    PUT_HEADER(run, PACK(size, GET_PREV(HEADER(run)), 1));
+
+    char *tail = run + size;
+    PUT_HEADER(tail, PACK(rest, PREV_BITS(size, 1), 1));
+    PUT_RUN_MAP(ctx->run_map, tail, true);
+    run_insert(tail);
+}
+
+// Takes a run of enough pages for the payload, the shortest free one that fits split down to
+// size, or otherwise a new one carved out of the heap. The list of the longest runs is not
+// sorted and is searched for the first that fits
+static void *run_malloc(size_t size)
+{
+    size_t run_size = RUN_SIZE(size);
+    uint64_t classes = ctx->run_bitmap & (~0ULL << RUN_CLASS(run_size));
+    char *run = NULL;
+
+    if (classes != 0) {
+        run = ctx->run_lists[LSB(classes)];
+        while (run != NULL && GET_SIZE(HEADER(run)) < run_size) run = GET_NEXT_FREE(run);
+    }
+    if (run != NULL) {
+        run_remove(run);
+        run_split(run, run_size);
+        return run;
+    }
+
+    if ((run = carve_aligned(run_size, RUN_PAGE_SIZE)) == NULL) return NULL;
+
+    // A run past the end of the page map couldn't be told apart from a block
+    if (((uint64_t)run - (uint64_t)mem_heap_lo_h(ctx->heap)) / RUN_PAGE_SIZE >= RUN_MAP_PAGES) {
+        free_block(run);
+        return NULL;
+    }
+    PUT_RUN_MAP(ctx->run_map, run, true);
+    return run;
+}
+
+// Frees a run, merging it with a free run right after it and one right before it. The last
+// word before the run would hold the size of the one before, which is then checked against
+// the page map and its header
+static void run_free(char *run)
+{
+    size_t size = GET_SIZE(HEADER(run));
+    char *next = run + size;
+
+    if (IS_FREE_RUN(next)) {
+        run_remove(next);
+        PUT_RUN_MAP(ctx->run_map, next, false);
+        size += GET_SIZE(HEADER(next));
+    }
+
+    uint64_t prev_size = GET_TAG(run - 2*HEAD_SIZE);
+    if (prev_size > 0 && prev_size <= (uint64_t)(run - ctx->heap_start) && IS_FREE_RUN(run - prev_size) && GET_SIZE(HEADER(run - prev_size)) == prev_size) {
+        run_remove(run - prev_size);
+        PUT_RUN_MAP(ctx->run_map, run, false);
+        run -= prev_size;
+        size += prev_size;
+    }
+
+    PUT_HEADER(run, PACK(size, GET_PREV(HEADER(run)), 1));
+    run_insert(run);
+}
+
+// Maps a region of whole pages for a large request and puts it on the registry, returns its payload
+static void *large_malloc(size_t size)
+{
+    size_t region_size = LARGE_REGION_SIZE(size);
+    char *region = mem_map_region_h(ctx->heap, region_size);
+    if (region == NULL) return NULL;
+
+    char *addr = region + LARGE_HEADER_SIZE;
+    PUT_TAG(HEADER(addr), PACK(0, 0, 1));
+    PUT(addr - LARGE_HEADER_SIZE + DHEAD_SIZE, size);
+    PUT(addr - LARGE_HEADER_SIZE + DHEAD_SIZE + WORD_SIZE, (uint64_t)ctx);
+    PUT(addr - LARGE_HEADER_SIZE + 2*DHEAD_SIZE, region_size);
+
+    PUT_PREV_LARGE(addr, NULL);
+    PUT_NEXT_LARGE(addr, ctx->large_objects);
+    if (ctx->large_objects != NULL) PUT_PREV_LARGE(ctx->large_objects, addr);
+    ctx->large_objects = addr;
+
+    return addr;
+}
+
+// Takes a large object off the registry and unmaps its region
+static void large_free(char *addr)
+{
+    char *prev = GET_PREV_LARGE(addr), *next = GET_NEXT_LARGE(addr);
+
+    if (next != NULL) PUT_PREV_LARGE(next, prev);
+    if (prev != NULL) PUT_NEXT_LARGE(prev, next);
+    else ctx->large_objects = next;
+
+    mem_unmap_region_h(ctx->heap, addr - LARGE_HEADER_SIZE, GET_LARGE_SIZE(addr));
+}
+
+// Resizes the region of a large object to hold a request of given size, its pages are moved
+// rather than copied if it can't stay in place. Returns the payload, or NULL with the object
+// left as it was
+static char *large_realloc(char *addr, size_t size)
+{
+    size_t region_size = LARGE_REGION_SIZE(size);
+    char *region = addr - LARGE_HEADER_SIZE;
+
+    if (region_size != GET_LARGE_SIZE(addr) && (region = mem_remap_region_h(ctx->heap, region, GET_LARGE_SIZE(addr), region_size)) == NULL) return NULL;
+
+    // The registry links in the region moved along with it, only its neighbors need to learn the new address
+    addr = region + LARGE_HEADER_SIZE;
+    PUT(addr - LARGE_HEADER_SIZE + DHEAD_SIZE, size);
+    PUT(addr - LARGE_HEADER_SIZE + 2*DHEAD_SIZE, region_size);
+
+    if (GET_PREV_LARGE(addr) != NULL) PUT_NEXT_LARGE(GET_PREV_LARGE(addr), addr);
+    else ctx->large_objects = addr;
+    if (GET_NEXT_LARGE(addr) != NULL) PUT_PREV_LARGE(GET_NEXT_LARGE(addr), addr);
+
+    return addr;
+}
+
+/*
+ * mm_context_create - makes an allocator context of its own on the given heap, with its
+ * bookkeeping kept apart from the heap. It takes mm_ctx_init before the first allocation.
+ * Returns NULL on error
+ */
+mm_context_t *mm_context_create(mem_heap_t *heap)
+{
+    mm_context_t *context = mem_meta_map(sizeof(mm_context_t));
+    if (context == NULL) return NULL;
+
+    context->heap = heap;
+    context->engine = ENGINE_FREELIST;
+#ifdef MM_THREADS
+    pthread_mutex_init(&context->lock, NULL);
+#endif
+    return context;
+}
+
+/*
+ * mm_context_destroy - drops a context from mm_context_create, its heap is left alone
+ */
+void mm_context_destroy(mm_context_t *context)
+{
+#ifdef MM_THREADS
+    pthread_mutex_destroy(&context->lock);
+#endif
+#ifdef MM_SIDE_TABLE
+    if (context->side_table != NULL) mem_meta_unmap(context->side_table, SIDE_TABLE_GRANULES * sizeof(uint32_t));
+#endif
+    mem_meta_unmap(context, sizeof(mm_context_t));
+}
+
+#ifdef MM_THREADS
+
+// Stops the background thread if it runs, the blocks left on the rings are up to the caller
+static void background_stop(void)
+{
+    if (!background_running) return;
+
+    __atomic_store_n(&background_running, false, __ATOMIC_RELEASE);
+    pthread_join(background_thread, NULL);
+}
+
+// Drops every arena but the default context, their heaps are as stale as the default one once
+// mm_init starts over, and sizes the arenas to the CPUs. The calling thread keeps the default
+// context. Blocks still on the free rings are from the old heaps too, the background thread
+// starts over on the next free
+static void arena_reset(void)
+{
+    background_stop();
+    for (struct free_ring *ring = free_rings; ring != NULL; ring = ring->next) ring->head = ring->tail;
+
+    for (int index = 1; index < MAX_ARENAS; index++) {
+        mm_context_t *arena = arenas[index];
+        if (arena == NULL) continue;
+
+        arenas[index] = NULL;
+        mem_heap_destroy(arena->heap);
+        mm_context_destroy(arena);
+    }
+
+    default_context.remote_frees = NULL;
+    tcache_shared = false;
+    long cpus = (arena_forced > 0) ? arena_forced : sysconf(_SC_NPROCESSORS_ONLN);
+    arena_limit = (cpus < 1) ? 1 : (cpus > MAX_ARENAS) ? MAX_ARENAS : (int)cpus;
+    arena_main = pthread_self();
+}
+
+#else
+
+static void arena_reset(void) {}
+
+#endif /* MM_THREADS */
+
+/*
+ * Initialize: returns false on error, true on success.
+ */
+bool mm_init(void)
+{
+    if (ctx->heap == NULL) ctx->heap = mem_default_heap();
+    if (ctx == &default_context) {
+        tcache_generation++;
+        arena_reset();
+    }
+    if (ctx->engine == ENGINE_BUDDY) return buddy_init();
+
+#ifdef MM_SIDE_TABLE
+    // The side table is mapped once for good, every entry is written before it is read again
+    if (ctx->side_table == NULL && (ctx->side_table = mem_meta_map(SIDE_TABLE_GRANULES * sizeof(uint32_t))) == NULL) return false;
+#endif
+
+    // Create the initial empty heap and make sure it is the same address as mem heap lo */
+    if ((ctx->heap_start = (char *)mem_sbrk_h(ctx->heap, 2*DHEAD_SIZE)) == (void *)-1) return false;
+    if ((uint64_t)ctx->heap_start != (uint64_t)mem_heap_lo_h(ctx->heap)) return false;
+
+    // Fill heap with padding/buffer, then the header and footer of a prologue block whose payload
+    // is aligned, and the buffer header
+    ctx->heap_start += DHEAD_SIZE;
+    PUT(ctx->heap_start - DHEAD_SIZE, 0);
+    PUT_HEADER(ctx->heap_start, PACK(DHEAD_SIZE, PREV_BITS(0, 1), 1));
+    PUT_TAG(FOOTER(ctx->heap_start), PACK(DHEAD_SIZE, PREV_BITS(0, 1), 1));
+    PUT_HEADER(ctx->heap_start + DHEAD_SIZE, PACK(0, PREV_BITS(DHEAD_SIZE, 1), 1));
+
+    // Empty every free list
+    ctx->fl_bitmap = 0;
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        ctx->sl_bitmap[fl] = 0;
+        for (int sl = 0; sl < SL_COUNT; sl++) ctx->free_lists[fl][sl] = NULL;
+    }
+    ctx->mini_bitmap = 0;
+    for (int list = 0; list < MINI_LISTS; list++) ctx->mini_lists[list] = NULL;
+
+    // Empty every slab class and the part of the page map that was used
+    for (int class = 0; class < SLAB_CLASSES; class++) {
+        ctx->slab_pages[class] = NULL;
+        ctx->slab_requests[class] = 0;
+    }
+    for (size_t word = 0; word < (ctx->slab_map_top + 63) / 64; word++) ctx->slab_map[word] = 0;
+    ctx->slab_map_top = 0;
+
+    // Empty every free run list and the part of the run page maps that was used
+    for (int class = 0; class < RUN_CLASSES; class++) ctx->run_lists[class] = NULL;
+    ctx->run_bitmap = 0;
+    for (size_t word = 0; word < (ctx->run_map_top + 63) / 64; word++) {
+        ctx->run_map[word] = 0;
+        ctx->free_run_map[word] = 0;
+    }
+    ctx->run_map_top = 0;
+
+    // Nothing is parked yet and there is no wilderness until the heap grows
+    ctx->wilderness = NULL;
+    for (int list = 0; list < QUICK_LISTS; list++) ctx->quick_lists[list] = NULL;
+    ctx->quick_bytes = 0;
+
+    // Regions of large objects went away with the heap
+    ctx->large_objects = NULL;
+
+    // The heap starts out empty, the first request grows it by the smallest chunk
+    growth_reset(&ctx->growth);
+
+    return true;
+}
+
+/*
+ * mm_set_engine - picks the allocator engine by name, freelist or buddy, for the
+ * next mm_init. Returns false if there is no such engine
+ */
+bool mm_set_engine(const char *name)
+{
+    if (strcmp(name, "freelist") == 0) ctx->engine = ENGINE_FREELIST;
+    else if (strcmp(name, "buddy") == 0) ctx->engine = ENGINE_BUDDY;
+    else return false;
+
+    return true;
+}
+
+/*
+ * mm_growth_stats - reports what the growth policy of the default context decided
+ */
+void mm_growth_stats(mm_growth_stats_t *stats)
+{
+    growth_policy_t *policy = &default_context.growth;
+
+    stats->grows = policy->grows;
+    stats->grown = policy->grown;
+    stats->needed = policy->needed;
+    stats->max_chunk = policy->max_chunk;
+}
+
+/*
+ * mm_ctx_init, mm_ctx_malloc, mm_ctx_free, mm_ctx_realloc, mm_ctx_calloc, mm_ctx_checkheap -
+ * the entry points on a given context, which is the current one for the length of the call
+ */
+bool mm_ctx_init(mm_context_t *context)
+{
+    mm_context_t *saved = ctx;
+    ctx = context;
+    bool ok = mm_init();
+    ctx = saved;
+    return ok;
+}
+
+void *mm_ctx_malloc(mm_context_t *context, size_t size)
+{
+    mm_context_t *saved = ctx;
+    ctx = context;
+    void *ptr = malloc(size);
+    ctx = saved;
+    return ptr;
+}
+
+void mm_ctx_free(mm_context_t *context, void *ptr)
+{
+    mm_context_t *saved = ctx;
+    ctx = context;
+    free(ptr);
+    ctx = saved;
+}
+
+void *mm_ctx_realloc(mm_context_t *context, void *ptr, size_t size)
+{
+    mm_context_t *saved = ctx;
+    ctx = context;
+    ptr = realloc(ptr, size);
+    ctx = saved;
+    return ptr;
+}
+
+void *mm_ctx_calloc(mm_context_t *context, size_t nmemb, size_t size)
+{
+    mm_context_t *saved = ctx;
+    ctx = context;
+    void *ptr = calloc(nmemb, size);
+    ctx = saved;
+    return ptr;
+}
+
+bool mm_ctx_checkheap(mm_context_t *context, int lineno)
+{
+    mm_context_t *saved = ctx;
+    ctx = context;
+    bool ok = mm_checkheap(lineno);
+    ctx = saved;
+    return ok;
+}
+
+/*
+ * heap_malloc - malloc on the current context, with its lock held
+ */
+static void *heap_malloc(size_t size)
+{
+
+    size_t asize; 
+    char *addr;
+    int class = -1;
+
+    if (ctx->engine == ENGINE_BUDDY) return buddy_malloc(size);
+    if (size == 0) return NULL;
+
+    ctx->growth.requests++;
+
+    // Large requests bypass the heap
+    if (size >= LARGE_MIN_SIZE && (addr = large_malloc(size)) != NULL)
+    {
+        dbg_printf("\nMALLOC CALL OF SIZE %lx MAPPED AT %p\n", (uint64_t)size, (void *)addr);
+        if (!mm_checkheap(__LINE__)) return false;
+        return addr;
+    }
+
+    // Small size classes in heavy use whose header would cost a whole alignment step get a slot
+    // of a slab page, as long as one of their pages has a free slot
+    if (size <= SLAB_CLASSES * ALIGNMENT && align(size) < block_size(size) && ++ctx->slab_requests[(size - 1) / ALIGNMENT] > SLAB_THRESHOLD)
+    {
+        class = (size - 1) / ALIGNMENT;
+        if ((addr = slab_malloc(class)) != NULL)
+        {
+            dbg_printf("\nMALLOC CALL OF SIZE %lx PLACED IN SLAB SLOT AT ADDRESS %lx\n", (uint64_t)size, (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+            if (!mm_checkheap(__LINE__)) return false;
+            return addr;
+        }
+    }
+
+    // Medium requests get a run of whole pages
+    if (size >= RUN_MIN_SIZE && size <= RUN_MAX_SIZE && (addr = run_malloc(size)) != NULL)
+    {
+        dbg_printf("\nMALLOC CALL OF SIZE %lx PLACED IN RUN AT ADDRESS %lx\n", (uint64_t)size, (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+        if (!mm_checkheap(__LINE__)) return false;
+        return addr;
+    }
+
+    // Properly align given size plus the header, large enough to hold a free block later
+    asize = block_size(size);
+
+    dbg_printf("\nMALLOC CALL OF SIZE %lx ALIGNED TO %lx", (uint64_t)size, (uint64_t)asize);
+
+    // A parked block of this exact size is already placed
+    if ((addr = quick_get(asize)) != NULL)
+    {
+        dbg_printf(" WAS TAKEN BACK FROM A QUICK LIST AT ADDRESS %lx\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+        if (!mm_checkheap(__LINE__)) return false;
+        return addr;
+    }
+
+    // The request comes off the wilderness below, or off a slab page carved out of it, if that has
+    // room as it is. The parked blocks and free runs only go back to the heap when it would grow
+    bool tail_fits = WILDERNESS_SIZE() >= asize;
+
+    // There is a fit in the heap, possibly once the parked blocks or the free runs went back to it
+    if ((addr = find_fit(asize)) != NULL || (!tail_fits && quick_release_all() && (addr = find_fit(asize)) != NULL) || (!tail_fits && run_release_all() && (addr = find_fit(asize)) != NULL))
+    {
+
+        place(addr,asize);
+
+        // Check if heap is still correct after placement and display placement address
+        dbg_printf(" WAS PLACED AT ADDRESS %lx\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+        if (!mm_checkheap(__LINE__)) return false;
+
+        return addr;
+    }
+
+    // There is no fit in the heap, a slab class makes a new page before the heap grows for a block
+    if (class >= 0 && slab_new_page(class) != NULL)
+    {
+        addr = slab_malloc(class);
+
+        dbg_printf(" WAS PLACED IN A NEW SLAB PAGE AT ADDRESS %lx\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+        if (!mm_checkheap(__LINE__)) return false;
+
+        return addr;
+    }
+
+    // There is no fit in the heap, the block comes off the wilderness, which grows if it must. A
+    // compressed heap that can't grow any more hands the request to a region of its own instead
+    if ((addr = wilderness_take(asize)) == NULL)
+    {  
+#ifdef MM_COMPRESSED
+        addr = large_malloc(size);
+        dbg_printf(" WAS MAPPED PAST THE COMPRESSED HEAP AT %p\n", (void *)addr);
+        return addr;
+#else
+        return NULL;
+#endif
+    }
+
+    // Check if heap is still correct after placement and display placement address
+    dbg_printf(" WAS PLACED AT ADDRESS %lx\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+    if (!mm_checkheap(__LINE__)) return false;
+    
+
+    return addr;
+    
+
+}
+
+
+/*
+ * heap_trim - shrinks the heap of the current context by the free space at its end, all
+ * but pad bytes of it. Parked blocks and free runs go back to the heap first so those at
+ * the end count.
+ * Returns whether the heap shrank
+ */
+static bool heap_trim(size_t pad)
+{
+    if (ctx->engine == ENGINE_BUDDY) return false;
+
+    quick_release_all();
+    run_release_all();
+
+    char *end = (char *)mem_heap_hi_h(ctx->heap) + 1;
+    if (GET_PREV_ALLOC(HEADER(end))) return false;
+
+    char *last = PREV_ADDR(end);
+    size_t size = GET_SIZE(HEADER(last));
+    size_t keep = (pad == 0) ? 0 : (align(pad) < MINI_SIZE) ? MINI_SIZE : align(pad);
+
+    // Less than a page wouldn't give anything back to the system
+    if (keep >= size || size - keep < mem_pagesize()) return false;
+
+    REMOVE_FREELIST(last);
+    if (keep > 0) {
+        PUT_FREE_BLOCK(last, keep, GET_PREV(HEADER(last)));
+        PUT_HEADER(last + keep, PACK(0, PREV_BITS(keep, 0), 1));
+        NEW_FREELIST_ENTRY(last);
+    }
+    else PUT_HEADER(last, PACK(0, GET_PREV(HEADER(last)), 1));
+
+    if ((long)mem_sbrk_h(ctx->heap, -(intptr_t)(size - keep)) == -1) return false;
+
+    dbg_printf("\nTRIMMED %lx BYTES OFF THE END OF THE HEAP\n", (uint64_t)(size - keep));
+    if (!mm_checkheap(__LINE__)) return false;
+    return true;
+}
+
+/*
+ * heap_free - free on the current context, with its lock held
+ */
+static void heap_free(void *ptr)
+{
+    if (ptr == NULL) return;
+
+    if (ctx->engine == ENGINE_BUDDY) {
+        buddy_free(ptr);
+        return;
+    }
+
+    dbg_printf("\nFREE CALL AT ADDRESS %lx\n", (uint64_t)ptr - (uint64_t)mem_heap_lo_h(ctx->heap));
+
+    // Large objects, runs and slots have their own free, small blocks are parked and the rest
+    // go back to the free index
+    if (IS_LARGE(ptr)) large_free(ptr);
+    else if (IS_RUN(ptr)) run_free(ptr);
+    else if (IS_SLAB(ptr)) slab_free(ptr);
+    else if (!quick_put(ptr)) free_block(ptr);
+
+    // Give a large free block at the end of the heap back
+    char *end = (char *)mem_heap_hi_h(ctx->heap) + 1;
+    if (!GET_PREV_ALLOC(HEADER(end)) && GET_SIZE(HEADER(PREV_ADDR(end))) > TRIM_THRESHOLD) heap_trim(TRIM_PAD);
+
+    if (!mm_checkheap(__LINE__)) exit(0);
+    return;
+}
+
+/*
+ * heap_realloc - realloc on the current context, with its lock held
+ */
+static void *heap_realloc(void *oldptr, size_t size)
+{
+    if (ctx->engine == ENGINE_BUDDY) return buddy_realloc(oldptr, size);
+
+    // Free call
+    if (size == 0)
+    {
+        heap_free(oldptr);
+        return NULL;
+    }
+
+    // Malloc call
+    else if (oldptr == NULL)
+    {
+        char *addr = heap_malloc(size);
+        return addr;
+    }
+
+    // Realloc call
+    else
+    {
+
+        // A large object that stays large resizes its region without copying, otherwise the payload moves
+        if (IS_LARGE(oldptr))
+        {
+            char *addr;
+            if (size >= LARGE_MIN_SIZE && (addr = large_realloc(oldptr, size)) != NULL)
+            {
+                if (!mm_checkheap(__LINE__)) return NULL;
+                return addr;
+            }
+
+            void *new_ptr = heap_malloc(size);
+            if (new_ptr == NULL) return NULL;
+            memcpy(new_ptr, oldptr, (size < GET_LARGE_REQUEST(oldptr)) ? size : GET_LARGE_REQUEST(oldptr));
+            heap_free(oldptr);
+            return new_ptr;
+        }
+
+        // A slot can't grow, the payload moves once it no longer fits
+        if (IS_SLAB(oldptr))
+        {
+            size_t slot_size = GET_SLOT_SIZE(SLAB_PAGE(oldptr));
+            if (size <= slot_size) return oldptr;
+
+            void *new_ptr = heap_malloc(size);
+            if (new_ptr == NULL) return NULL;
+            memcpy(new_ptr, oldptr, slot_size);
+            heap_free(oldptr);
+            return new_ptr;
+        }
+
+        // A run grows into a free run right after it, otherwise the payload moves
+        if (IS_RUN(oldptr))
+        {
+            size_t run_size = GET_SIZE(HEADER(oldptr)), need = RUN_SIZE(size);
+            char *next = oldptr + run_size;
+
+            if (need <= run_size) return oldptr;
+            if (IS_FREE_RUN(next) && run_size + GET_SIZE(HEADER(next)) >= need)
+            {
+                run_remove(next);
+                PUT_RUN_MAP(ctx->run_map, next, false);
+                PUT_HEADER(oldptr, PACK(run_size + GET_SIZE(HEADER(next)), GET_PREV(HEADER(oldptr)), 1));
+                run_split(oldptr, need);
+
+                if (!mm_checkheap(__LINE__)) return NULL;
+                return oldptr;
+            }
+
+            void *new_ptr = heap_malloc(size);
+            if (new_ptr == NULL) return NULL;
+            memcpy(new_ptr, oldptr, run_size - HEAD_SIZE);
+            heap_free(oldptr);
+            return new_ptr;
+        }
+
+        size_t old_size = GET_SIZE(HEADER(oldptr));
+        size_t new_size = block_size(size);
+
+        // Shrinking, the tail is given back when it is large enough to be a block of its own
+        if (old_size >= new_size)
+        {
+            if ((old_size - new_size) >= MINI_SIZE)
+            {
+                PUT_HEADER(oldptr, PACK(new_size, GET_PREV(HEADER(oldptr)), 1));
+
+                // Turn the tail into a free block and tell the block after it
+                char *tail = NEXT_ADDR(oldptr);
+                PUT_FREE_BLOCK(tail, old_size - new_size, PREV_BITS(new_size, 1));
+                PUT_PREV(HEADER(NEXT_ADDR(tail)), PREV_BITS(old_size - new_size, 0));
+
+                // Merge it with a free right neighbor before it goes back on the free index
+                NEW_FREELIST_ENTRY(coalesce(tail));
+
+                if (!mm_checkheap(__LINE__)) return NULL;
+            }
+            return oldptr;
+        }
+
+        char *next = NEXT_ADDR(oldptr);
+        size_t next_size = GET_ALLOC(HEADER(next)) ? 0 : GET_SIZE(HEADER(next));
+
+        // The next block is free and large enough, absorb it and split off what is not needed
+        if (old_size + next_size >= new_size)
+        {
+            REMOVE_FREELIST(next);
+            allocate_block(oldptr, old_size + next_size, new_size);
+
+            if (!mm_checkheap(__LINE__)) return NULL;
+            return oldptr;
+        }
+
+        // The block is the last one in the heap, possibly followed by the wilderness, so the heap grows
+        // by the shortfall or a chunk and what the block doesn't need becomes the wilderness again.
+        // A heap that can't grow leaves the payload to move
+        bool last = (GET_SIZE(HEADER((next_size > 0) ? NEXT_ADDR(next) : next)) == 0);
+        size_t shortfall = new_size - old_size - next_size;
+        size_t grow = last ? growth_extension(&ctx->growth, shortfall) : 0;
+        if (last && HEAP_CAN_GROW(grow) && (long)mem_sbrk_h(ctx->heap, grow) != -1)
+        {
+            growth_record(&ctx->growth, shortfall, grow);
+            if (next_size > 0) REMOVE_FREELIST(next);
+
+            PUT_HEADER(oldptr + old_size + next_size + grow, PACK(0, 0, 1));
+            allocate_block(oldptr, old_size + next_size + grow, new_size);
+
+            if (!mm_checkheap(__LINE__)) return NULL;
+            return oldptr;
+        }
+
+        // The previous block is free and together with any free next block large enough,
+        // slide the payload back into it instead of copying to a fresh block
+        if (!GET_PREV_ALLOC(HEADER(oldptr)))
+        {
+            char *prev = PREV_ADDR(oldptr);
+            size_t prev_size = GET_SIZE(HEADER(prev));
+
+            if (prev_size + old_size + next_size >= new_size)
+            {
+                REMOVE_FREELIST(prev);
+                if (next_size > 0) REMOVE_FREELIST(next);
+
+                memmove(prev, oldptr, old_size - HEAD_SIZE);
+                allocate_block(prev, prev_size + old_size + next_size, new_size);
+
+                if (!mm_checkheap(__LINE__)) return NULL;
+                return prev;
+            }
+        }
+
+        // Perform corresponging malloc and free calls, only the old payload is copied
+        void *new_ptr = heap_malloc(size);
+        if (new_ptr == NULL) return NULL;
+        memcpy(new_ptr, oldptr, old_size - HEAD_SIZE);
+        heap_free(oldptr);
+        return new_ptr; 
+    }
+}
+
+#ifdef MM_THREADS
+
+// Makes the arena of given index on a heap instance of its own. Returns the default context if
+// that fails, so the call still has somewhere to go
+static mm_context_t *arena_create(int index)
+{
+    mem_heap_t *heap;
+
+    pthread_mutex_lock(&arena_mutex);
+    mm_context_t *arena = arenas[index];
+    if (arena == NULL && (heap = mem_heap_create()) != NULL) {
+        if ((arena = mm_context_create(heap)) != NULL && !mm_ctx_init(arena)) {
+            mm_context_destroy(arena);
+            arena = NULL;
+        }
+        if (arena == NULL) mem_heap_destroy(heap);
+        else __atomic_store_n(&arenas[index], arena, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&arena_mutex);
+
+    return (arena != NULL) ? arena : &default_context;
+}
+
+// Returns the index of the arena of this thread, the one of the CPU it runs on or one by a hash
+// of the thread where the CPU is unknown, or the turn of the thread with forced arenas. The
+// buddy engine only has the default context
+static int arena_home(void)
+{
+    if (arena_limit == 1 || default_context.engine != ENGINE_FREELIST || pthread_equal(pthread_self(), arena_main)) return 0;
+
+    if (arena_forced > 0) {
+        if (arena_turn < 0) arena_turn = __atomic_add_fetch(&arena_threads, 1, __ATOMIC_RELAXED);
+        return arena_turn % arena_limit;
+    }
+
+    int cpu = sched_getcpu();
+    uint64_t key = (cpu >= 0) ? (uint64_t)cpu : ((uint64_t)pthread_self() * 0x9E3779B97F4A7C15ULL) >> 32;
+    return key % arena_limit;
+}
+
+// Returns the arena of this thread, NULL if it wasn't made yet
+static mm_context_t *home_arena(void)
+{
+    return __atomic_load_n(&arenas[arena_home()], __ATOMIC_ACQUIRE);
+}
+
+// Returns the arena for a new allocation of this thread, made if it doesn't exist yet
+static mm_context_t *arena_pick(void)
+{
+    int index = arena_home();
+    mm_context_t *arena = __atomic_load_n(&arenas[index], __ATOMIC_ACQUIRE);
+    return (arena != NULL) ? arena : arena_create(index);
+}
+
+// Returns the arena the block at given address came from, the one whose heap reservation holds
+// it or for a large object the owner kept in its region
+static mm_context_t *arena_of(char *ptr)
+{
+    for (int index = 0; index < arena_limit; index++) {
+        mm_context_t *arena = __atomic_load_n(&arenas[index], __ATOMIC_ACQUIRE);
+        if (arena != NULL && mem_in_heap_h(arena->heap, ptr)) return arena;
+    }
+    return GET_LARGE_CONTEXT(ptr);
+}
+
+// Pushes a block freed by a thread of another arena on the remote free queue of its arena if the
+// given home arena of the freeing thread isn't its own, returns whether it did. Only the owner
+// ever pops, and it takes the whole queue at once, so a compare and swap on the head is enough
+static bool remote_free(char *ptr, mm_context_t *home)
+{
+    if (ptr == NULL || ctx != &default_context) return false;
+
+    mm_context_t *arena = arena_of(ptr);
+    if (arena == home) return false;
+
+    char *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+    do PUT(ptr, (uint64_t)head);
+    while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, ptr, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return true;
+}
+
+// Frees every block on the remote free queue of the current context, whose lock is held
+static void remote_drain(void)
+{
+    if (__atomic_load_n(&ctx->remote_frees, __ATOMIC_RELAXED) == NULL) return;
+
+    char *ptr = __atomic_exchange_n(&ctx->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (ptr != NULL) {
+        char *next = (char *)GET(ptr);
+        heap_free(ptr);
+        ptr = next;
+    }
+}
+
+// Locks the context a call works on and makes it current, returns the one to go back to. Calls
+// on the default context go to the arena of the given block, or to a new one's without a block.
+// Calls of an mm_ctx_ entry point stay on their context. Remote frees waiting for the lock go first
+static mm_context_t *arena_enter(char *ptr)
+{
+    mm_context_t *saved = ctx;
+
+    if (ctx == &default_context) ctx = (ptr != NULL) ? arena_of(ptr) : arena_pick();
+    pthread_mutex_lock(&ctx->lock);
+    remote_drain();
+    return saved;
+}
+
+static void arena_leave(mm_context_t *saved)
+{
+    pthread_mutex_unlock(&ctx->lock);
+    ctx = saved;
+}
+
+#else
+
+static mm_context_t *home_arena(void) {return NULL;}
+static bool remote_free(char *ptr, mm_context_t *home) {return false;}
+static mm_context_t *arena_enter(char *ptr) {return ctx;}
+static void arena_leave(mm_context_t *saved) {}
+
+#endif /* MM_THREADS */
+
+#ifdef MM_THREADS
+
+// Gives every block of this thread's cache back to its arena. Blocks of other arenas go on their
+// remote free queues first, while this thread is still on the default context, then the rest are
+// freed under a single lock of the arena of this thread
+static void tcache_flush(void)
+{
+    mm_context_t *home = home_arena();
+    char *local = NULL;
+
+    for (int bin = 0; bin < TCACHE_BINS; bin++) {
+        while (tcache.bins[bin] != NULL) {
+            char *addr = tcache.bins[bin];
+            tcache.bins[bin] = (char *)GET(addr);
+            if (remote_free(addr, home)) continue;
+
+            PUT(addr, (uint64_t)local);
+            local = addr;
+        }
+    }
+    tcache.bytes = 0;
+    if (local == NULL) return;
+
+    mm_context_t *saved = arena_enter(local);
+    while (local != NULL) {
+        char *next = (char *)GET(local);
+        heap_free(local);
+        local = next;
+    }
+    arena_leave(saved);
+}
+
+// Destructor of the cache key, flushes the cache of a thread when it exits and lets its ring go
+static void tcache_exit(void *cache)
+{
+    if (tcache.generation == tcache_generation) tcache_flush();
+    if (free_ring != NULL) __atomic_store_n(&free_ring->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_exit);
+}
+
+// Returns whether the calls of this thread go through its cache. Only the free list engine of
+// the default context has caches, the thread of mm_init uses its own only once another thread
+// called, and a cache filled before the last mm_init is dropped
+static bool tcache_ready(void)
+{
+    if (ctx != &default_context || ctx->engine != ENGINE_FREELIST) return false;
+
+    if (!pthread_equal(pthread_self(), arena_main)) {
+        if (!__atomic_load_n(&tcache_shared, __ATOMIC_RELAXED)) __atomic_store_n(&tcache_shared, true, __ATOMIC_RELAXED);
+    }
+    else if (!__atomic_load_n(&tcache_shared, __ATOMIC_RELAXED)) return false;
+
+    if (tcache.generation != tcache_generation) {
+        pthread_once(&tcache_once, tcache_key_create);
+        pthread_setspecific(tcache_key, &tcache);
+        for (int bin = 0; bin < TCACHE_BINS; bin++) tcache.bins[bin] = NULL;
+        tcache.bytes = 0;
+        tcache.generation = tcache_generation;
+    }
+    return true;
+}
+
+// Takes a cached block for a request of the given size, NULL if this thread has none. The bin
+// of a block size only holds blocks with at least the payload malloc gives a block of that size
+static void *tcache_get(size_t size)
+{
+    if (size == 0 || size >= TCACHE_BINS * ALIGNMENT || !tcache_ready()) return NULL;
+
+    size_t bin = block_size(size) / ALIGNMENT;
+    if (bin >= TCACHE_BINS || tcache.bins[bin] == NULL) return NULL;
+
+    char *addr = tcache.bins[bin];
+    tcache.bins[bin] = (char *)GET(addr);
+    tcache.bytes -= bin * ALIGNMENT;
+    return addr;
+}
+
+// Caches a freed slab slot or small block for this thread, returns false if it goes back to its
+// arena instead. The size of a block is read without the lock, neither the slab page map bit of
+// its arena nor the size in the header of an allocated block change until it is freed. Large
+// objects and runs have a header too whose size is past every bin
+static bool tcache_put(char *ptr)
+{
+    if (ptr == NULL || !tcache_ready()) return false;
+
+    ctx = arena_of(ptr);
+    size_t bin = IS_LARGE(ptr) ? TCACHE_BINS : (IS_SLAB(ptr) ? GET_SLOT_SIZE(SLAB_PAGE(ptr)) : GET_SIZE(HEADER(ptr))) / ALIGNMENT;
+    ctx = &default_context;
+    if (bin >= TCACHE_BINS) return false;
+
+    // A flush would hold locks for long, background free leaves the block to its thread instead
+    if (tcache.bytes + bin * ALIGNMENT > TCACHE_MAX_BYTES) {
+        if (background_on) return false;
+        tcache_flush();
+    }
+    PUT(ptr, (uint64_t)tcache.bins[bin]);
+    tcache.bins[bin] = ptr;
+    tcache.bytes += bin * ALIGNMENT;
+    return true;
+}
+
+#else
+
+static void *tcache_get(size_t size) {return NULL;}
+static bool tcache_put(char *ptr) {return false;}
+
+#endif /* MM_THREADS */
+
+#ifdef MM_THREADS
 
-        // Place new allocated header and footer in heap
-        PUT(HEADER(addr), PACK(new_size, 1));
-        PUT(FOOTER(addr), PACK(new_size, 1));
+// Returns the time of a monotonic clock in nanoseconds
+static long background_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
 
-        addr = NEXT_ADDR(addr);
+// Gives the blocks on the rings of every thread back to their arenas. Blocks in a row of the same
+// arena are freed under one lock until the time slice is over, then the lock is let go for the
+// threads of the arena. Returns whether there was any block
+static bool background_pass(void)
+{
+    bool found = false;
 
-        // Place new free header and footer in heap
-        PUT(HEADER(addr), PACK(old_size-new_size, 0));
-        PUT(FOOTER(addr), PACK(old_size-new_size, 0));
+    for (struct free_ring *ring = __atomic_load_n(&free_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        unsigned long head = ring->head, tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head != tail) found = true;
 
-        // Create new free list entry
-        NEW_FREELIST_ENTRY(addr);
-    }
+        while (head != tail) {
+            long start = background_clock();
+            mm_context_t *saved = arena_enter(ring->slots[head % FREE_RING_SIZE]);
+            do heap_free(ring->slots[head++ % FREE_RING_SIZE]);
+            while (head != tail && arena_of(ring->slots[head % FREE_RING_SIZE]) == ctx && background_clock() - start < BACKGROUND_SLICE_NS);
+            arena_leave(saved);
 
-    // Splitting is not necessary
-    else
-    {
-        // Place new allocated header and footer in heap
-        PUT(HEADER(addr), PACK(old_size, 1));
-        PUT(FOOTER(addr), PACK(old_size, 1));
+            __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        }
     }
+    return found;
 }
 
-// Checks if coalescing is needed at every possible case and performs it if so
-char *coalesce(char *addr)
+static void *background_main(void *arg)
 {
-    size_t prev = GET_ALLOC(FOOTER(PREV_ADDR(addr)));
-    size_t next = GET_ALLOC(HEADER(NEXT_ADDR(addr)));
-    size_t size = GET_SIZE(HEADER(addr));
+    struct timespec idle = {0, BACKGROUND_IDLE_NS};
 
-    // CASE 1: No coalescing needed
-    if (prev && next) {
-        return addr;
+    while (__atomic_load_n(&background_running, __ATOMIC_ACQUIRE)) {
+        if (!background_pass()) nanosleep(&idle, NULL);
     }
+    return NULL;
+}
 
-    // CASE 2: Coalesce the next block
-    else if (prev && !next) {
-
-        // Remove free list entry of next block
-        REMOVE_FREELIST(NEXT_ADDR(addr));
-
-        // Rewrite header and footer with new size
-        size += GET_SIZE(HEADER(NEXT_ADDR(addr)));
-        PUT(HEADER(addr), PACK(size, 0));
-        PUT(FOOTER(addr), PACK(size, 0));
-        
+// Starts the background thread unless it runs already or background free is off, returns
+// whether it runs
+static bool background_start(void)
+{
+    pthread_mutex_lock(&background_mutex);
+    if (background_on && !background_running) {
+        __atomic_store_n(&background_running, true, __ATOMIC_RELEASE);
+        if (pthread_create(&background_thread, NULL, background_main, NULL) != 0) background_running = false;
     }
+    pthread_mutex_unlock(&background_mutex);
 
-    // CASE 3: Coalesce the previous block
-    else if (!prev && next) {
-
-        // Remove free list entry of next block
-        REMOVE_FREELIST(PREV_ADDR(addr));
+    return background_running;
+}
 
-        // Rewrite header and footer with new size
-        size += GET_SIZE(HEADER(PREV_ADDR(addr)));
-        PUT(FOOTER(addr), PACK(size, 0));
-        PUT(HEADER(PREV_ADDR(addr)), PACK(size, 0));
+// Gives this thread a ring, one let go by a thread that exited or a new one
+static struct free_ring *ring_claim(void)
+{
+    struct free_ring *ring;
 
-        // Update return address
-        addr = PREV_ADDR(addr);
+    for (ring = __atomic_load_n(&free_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        bool idle = false;
+        if (__atomic_compare_exchange_n(&ring->in_use, &idle, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
     }
- 
-    // CASE 4: Coalesce both blocks
-    else { 
-
-        // Remove free list entry of previous and next block
-        REMOVE_FREELIST(PREV_ADDR(addr));
-        REMOVE_FREELIST(NEXT_ADDR(addr));
 
-        // Rewrite header and footer with new size
-        size += GET_SIZE(HEADER(PREV_ADDR(addr))) + GET_SIZE(FOOTER(NEXT_ADDR(addr)));
-        PUT(HEADER(PREV_ADDR(addr)), PACK(size, 0));
-        PUT(FOOTER(NEXT_ADDR(addr)), PACK(size, 0));
-
-        // Update return address
-        addr = PREV_ADDR(addr);
+    if (ring == NULL) {
+        if ((ring = mem_meta_map(sizeof(struct free_ring))) == NULL) return NULL;
+        ring->in_use = true;
+        ring->next = __atomic_load_n(&free_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&free_rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
     }
 
-    return addr;
+    free_ring = ring;
+    return ring;
 }
 
-// Extends the heap of given size, checks for coalescing, and creates new free list entry
-char *extend_heap(size_t size)
+// Puts a freed block on the ring of this thread for the background thread, returns false if
+// background free is off or the ring is full, and the block is freed right away instead
+static bool background_push(char *ptr)
 {
-    char *addr;
+    struct free_ring *ring = free_ring;
 
-    // Request space of given size
-    if ((long)(addr = mem_sbrk(size)) == -1) return NULL;
+    if (!background_on || ptr == NULL || ctx != &default_context) return false;
+    if (!__atomic_load_n(&background_running, __ATOMIC_ACQUIRE) && !background_start()) return false;
+    if (ring == NULL && (ring = ring_claim()) == NULL) return false;
 
-    // Initialize free block header/footer and the buffer header 
-    PUT(HEADER(addr), PACK(size, 0));  
-    PUT(FOOTER(addr), PACK(size, 0)); 
-    PUT(HEADER(NEXT_ADDR(addr)), PACK(0, 1)); 
+    unsigned long tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == FREE_RING_SIZE) return false;
 
-    char *new_addr = coalesce(addr);
+    ring->slots[tail % FREE_RING_SIZE] = ptr;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
 
-    NEW_FREELIST_ENTRY(new_addr);
+#else
 
-    return new_addr;
- }
+static bool background_push(char *ptr) {return false;}
+
+#endif /* MM_THREADS */
 
 /*
- * Initialize: returns false on error, true on success.
+ * mm_set_background_free - turns background free on or off. Turning it off stops the
+ * background thread and frees every block still on the rings, which must not get more
+ * meanwhile. Returns false if this build has no background free
  */
-bool mm_init(void)
+bool mm_set_background_free(bool on)
 {
+#ifdef MM_THREADS
+    pthread_mutex_lock(&background_mutex);
+    background_on = on;
+    if (!on) {
+        background_stop();
+        while (background_pass());
+    }
+    pthread_mutex_unlock(&background_mutex);
+    return true;
+#else
+    return !on;
+#endif
+}
 
-    // Create the initial empty heap and make sure it is the same address as mem heap lo */
-    if ((heap_start = (char *)mem_sbrk(4*HEAD_SIZE)) == (void *)-1) return false;
-    if ((uint64_t)heap_start != (uint64_t)mem_heap_lo()) return false;
-
-    // Fill heap with padding/buffer, header, and footer
-    PUT(heap_start, 0); 
-    PUT(heap_start + (1*HEAD_SIZE), PACK(DHEAD_SIZE, 1)); 
-    PUT(heap_start + (2*HEAD_SIZE), PACK(DHEAD_SIZE, 1)); 
-    PUT(heap_start + (3*HEAD_SIZE), PACK(0, 1));
-
-    // Set starting values for heap start, free list lo, and free list hi variables
-    heap_start += (2*HEAD_SIZE);
-    free_list_lo = heap_start;
-    free_list_hi = free_list_lo;
-
-    // Create starting room in heap
-    if (extend_heap((1<<12)/HEAD_SIZE) == NULL) return false;
+/*
+ * mm_set_arenas - forces the given number of arenas from the next mm_init on, which threads
+ * take in turn whatever CPU they run on, 0 goes back to one arena per CPU. Returns false if
+ * the number is past MAX_ARENAS or this build has no arenas
+ */
+bool mm_set_arenas(int count)
+{
+#ifdef MM_THREADS
+    if (count < 0 || count > MAX_ARENAS) return false;
+    arena_forced = count;
+    return true;
+#else
+    return count == 0;
+#endif
+}
 
+/*
+ * mm_set_large_threshold - makes requests of at least the given size get a region of their own
+ * from the next call on, objects already placed stay where they are. Returns false for 0, which
+ * would map a region for every request
+ */
+bool mm_set_large_threshold(size_t size)
+{
+    if (size == 0) return false;
+    LARGE_MIN_SIZE = size;
     return true;
 }
 
@@ -344,113 +2473,49 @@ bool mm_init(void)
  */
 void* malloc(size_t size)
 {
+    void *ptr;
 
-    size_t asize; 
-    char *addr;
-
-    if (size == 0) return NULL;
-
-    // Properly align given size
-    asize = align(size)+DHEAD_SIZE;
-
-    dbg_printf("\nMALLOC CALL OF SIZE %lx ALIGNED TO %lx", (uint64_t)size, (uint64_t)asize);
-
-    // There is a fit in the heap
-    if ((addr = find_fit(asize)) != NULL)
-    {
-
-        place(addr,asize);
-
-        // Check if heap is still correct after placement and display placement address
-        dbg_printf(" WAS PLACED AT ADDRESS %lx\n", (uint64_t)addr - (uint64_t)mem_heap_lo());
-        if (!mm_checkheap(__LINE__)) return false;
-
-        return addr;
-    }
-
-    // There is no fit in the heap, need to request more space
-    if ((addr = extend_heap(asize)) == NULL)
-    {  
-        return NULL;
-    }
-
-    place(addr, asize);
-
-    // Check if heap is still correct after placement and display placement address
-    dbg_printf(" WAS PLACED AT ADDRESS %lx\n", (uint64_t)addr - (uint64_t)mem_heap_lo());
-    if (!mm_checkheap(__LINE__)) return false;
-    
-
-    return addr;
-    
+    if ((ptr = tcache_get(size)) != NULL) return ptr;
 
+    mm_context_t *saved = arena_enter(NULL);
+    ptr = heap_malloc(size);
+    arena_leave(saved);
+    return ptr;
 }
 
-
 /*
  * free
  */
 void free(void* ptr)
 {
+    if (tcache_put(ptr) || remote_free(ptr, home_arena()) || background_push(ptr)) return;
 
-    dbg_printf("\nFREE CALL AT ADDRESS %lx\n", (uint64_t)ptr - (uint64_t)mem_heap_lo());
-    size_t size = GET_SIZE(HEADER(ptr));
-
-    // Put a header and footer at the given address
-    PUT(HEADER(ptr), PACK(size, 0)); 
-    PUT(FOOTER(ptr), PACK(size, 0));
-
-    // Check if coalecsing is necessary
-    char *addr = coalesce(ptr);
-
-    NEW_FREELIST_ENTRY(addr);
-
-    if (!mm_checkheap(__LINE__)) exit(0);
-    return;
+    mm_context_t *saved = arena_enter(ptr);
+    heap_free(ptr);
+    arena_leave(saved);
 }
 
 /*
- * realloc
+ * realloc - blocks in a thread cache are allocated as far as the heap can tell, so
+ * only the heap takes part
  */
 void* realloc(void* oldptr, size_t size)
 {
+    mm_context_t *saved = arena_enter(oldptr);
+    void *ptr = heap_realloc(oldptr, size);
+    arena_leave(saved);
+    return ptr;
+}
 
-    // Free call
-    if (size == 0)
-    {
-        free(oldptr);
-        return NULL;
-    }
-
-    // Malloc call
-    else if (oldptr == NULL)
-    {
-        char *addr = malloc(size);
-        return addr;
-    }
-
-    // Realloc call
-    else
-    {
-
-        size_t old_size = GET_SIZE(HEADER(oldptr));
-        size_t new_size = align(size) +DHEAD_SIZE ;
-
-        // Perform corresponging malloc and free calls
-        if(old_size < new_size)
-        {
-            void *new_ptr = malloc(new_size);
-            memcpy(new_ptr, oldptr, old_size);
-            free(oldptr);
-            return new_ptr; 
-        }
-
-        // Nothing needs to be changed
-        else
-        {   
-            return oldptr;
-        }
-    }
+/*
+ * mm_trim - trims the heap of the arena of the calling thread
+ */
+bool mm_trim(size_t pad)
+{
+    mm_context_t *saved = arena_enter(NULL);
+    bool trimmed = heap_trim(pad);
+    arena_leave(saved);
+    return trimmed;
 }
 
 /*
@@ -459,10 +2524,24 @@ void* realloc(void* oldptr, size_t size)
  */
 void* calloc(size_t nmemb, size_t size)
 {
-    void* ptr;
+    char *ptr, *zeroed_lo = NULL, *zeroed_hi = NULL;
     size *= nmemb;
-    ptr = malloc(size);
-    if (ptr) {
+
+    if ((ptr = tcache_get(size)) == NULL) {
+        mm_context_t *saved = arena_enter(NULL);
+        ctx->zeroed_lo = ctx->zeroed_hi = NULL;
+        ptr = heap_malloc(size);
+        zeroed_lo = ctx->zeroed_lo;
+        zeroed_hi = ctx->zeroed_hi;
+        arena_leave(saved);
+    }
+
+    // Pages of a decommitted block fault back in zeroed, only the rest of the payload is cleared
+    if (ptr && zeroed_lo >= ptr && zeroed_lo < ptr + size) {
+        memset(ptr, 0, zeroed_lo - ptr);
+        if (zeroed_hi < ptr + size) memset(zeroed_hi, 0, ptr + size - zeroed_hi);
+    }
+    else if (ptr) {
         memset(ptr, 0, size);
     }
     return ptr;
@@ -481,21 +2560,23 @@ static bool aligned(const void* p)
 // Goes through the heap and outputs each header pack and address
 void print_heap() {
     dbg_printf("\n\n     --- MM CHECK HEAP: HEADERS AND FOOTERS ---\n");
-    dbg_printf("Low: %lx%8cHigh: %lx\n", (uint64_t)mem_heap_lo() - (uint64_t)mem_heap_lo(), ' ', (uint64_t)mem_heap_hi() - (uint64_t)mem_heap_lo());
+    dbg_printf("Low: %lx%8cHigh: %lx\n", (uint64_t)mem_heap_lo_h(ctx->heap) - (uint64_t)mem_heap_lo_h(ctx->heap), ' ', (uint64_t)mem_heap_hi_h(ctx->heap) - (uint64_t)mem_heap_lo_h(ctx->heap));
 
-    char *addr = heap_start;
+    char *addr = ctx->heap_start;
 
     int count = 1;
 
     // Iterate through each header address of the heap
-    while(GET_SIZE(HEADER(addr)) > 0){
+    while(BLOCK_SIZE(addr) > 0){
         
         dbg_printf("---------------------------------------------------\n");
-        dbg_printf("%d%11cSize|       Allocated|         Address|\n", count, ' ');        
+        dbg_printf("%d%11cSize|       Allocated|  Prev Allocated|         Address|\n", count, ' ');        
         
-        // Print header and footer
-        dbg_printf("Head%12lx|%16lx|%16lx|\n", GET_SIZE(HEADER(addr)), GET_ALLOC(HEADER(addr)), (uint64_t)addr - (uint64_t)mem_heap_lo());
-        dbg_printf("Foot%12lx|%16lx|%16lx|\n", GET_SIZE(FOOTER(addr)), GET_ALLOC(FOOTER(addr)), (uint64_t)addr - (uint64_t)mem_heap_lo());  
+        // Print header and, for free blocks, footer
+        dbg_printf("Head%12lx|%16lx|%16lx|%16lx|\n", BLOCK_SIZE(addr), BLOCK_ALLOC(addr), GET_PREV_ALLOC(HEADER(addr)), (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+        if (!BLOCK_ALLOC(addr) && BLOCK_SIZE(addr) > MINI_SIZE) {
+            dbg_printf("Foot%12lx|%16lx|%16c|%16lx|\n", GET_SIZE(FOOTER(addr)), GET_ALLOC(FOOTER(addr)), ' ', (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+        }
   
         count += 1;
         addr = NEXT_ADDR(addr);
@@ -505,94 +2586,212 @@ void print_heap() {
     return;
 }
 
-// Goes through the free list and outputs each entry
+// Goes through a best fit tree in order and outputs each node
+void print_free_tree(char *root, int depth) {
+    if (root == NULL) return;
+
+    print_free_tree(GET_LEFT(root), depth + 1);
+    dbg_printf("Tree depth %2d size %12lx height %2ld address %16lx\n", depth, BLOCK_SIZE(root), GET_HEIGHT(root), (uint64_t)root - (uint64_t)mem_heap_lo_h(ctx->heap));
+    print_free_tree(GET_RIGHT(root), depth + 1);
+
+    return;
+}
+
+// Goes through every segregated free list and best fit tree and outputs each entry
 void print_freelist() {
     dbg_printf("\n\n         --- MM CHECK HEAP: FREE LIST ---\n");
-    dbg_printf("Low: %lx%8cHigh: %lx\n", (uint64_t)free_list_lo - (uint64_t)mem_heap_lo(), ' ', (uint64_t)free_list_hi - (uint64_t)mem_heap_lo());
-
-    char *addr = free_list_lo;
+    dbg_printf("First level bitmap: %lx\n", ctx->fl_bitmap);
 
     int count = 1;
 
-    // Iterate through each free list entry of the heap
-    do {
-        dbg_printf("---------------------------------------------------\n");
+    // Iterate through each free list entry of the heap, one size class at a time
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        for (int sl = 0; sl < SL_COUNT; sl++) {
 
-        // Print current address, previous free address, and next free address
-        dbg_printf("%d%11cPrev|            Next|         Address|\n", count, ' ');
-        dbg_printf("%16lx|%16lx|%16lx|\n", (uint64_t)GET_PREV_FREE(addr) - (uint64_t)mem_heap_lo(), (uint64_t)GET_NEXT_FREE(addr) - (uint64_t)mem_heap_lo(), (uint64_t)addr - (uint64_t)mem_heap_lo());        
+            // Large classes hold a tree instead of a list
+            if (ctx->free_lists[fl][sl] != NULL && BLOCK_SIZE(ctx->free_lists[fl][sl]) >= TREE_MIN_SIZE) {
+                dbg_printf("---------------------------------------------------\n");
+                dbg_printf("Class %d,%d tree\n", fl, sl);
+                print_free_tree(ctx->free_lists[fl][sl], 0);
+                continue;
+            }
 
-        count += 1;
-    } while((addr = GET_NEXT_FREE(addr)) != free_list_lo);
+            // Mini blocks only have a next link and are spread over the mini lists
+            if (ctx->free_lists[fl][sl] != NULL && BLOCK_SIZE(ctx->free_lists[fl][sl]) == MINI_SIZE) {
+                dbg_printf("---------------------------------------------------\n");
+                dbg_printf("Class %d,%d mini lists, bitmap %lx\n", fl, sl, ctx->mini_bitmap);
+                for (int list = 0; list < MINI_LISTS; list++)
+                    for (char *addr = ctx->mini_lists[list]; addr != NULL; addr = GET_NEXT_MINI(addr))
+                        dbg_printf("Mini list %2d next %16lx address %16lx\n", list, (uint64_t)GET_NEXT_MINI(addr), (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+                continue;
+            }
+
+            for (char *addr = ctx->free_lists[fl][sl]; addr != NULL; addr = GET_NEXT_FREE(addr)) {
+                dbg_printf("---------------------------------------------------\n");
+
+                // Print class, current address, previous free address, and next free address
+                dbg_printf("%d%5cClass|            Prev|            Next|         Address|\n", count, ' ');
+                dbg_printf("%7d,%2d|%16lx|%16lx|%16lx|\n", fl, sl, (uint64_t)GET_PREV_FREE(addr), (uint64_t)GET_NEXT_FREE(addr), (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+
+                count += 1;
+            }
+        }
+    }
     dbg_printf("---------------------------------------------------\n");
 
     return;
 
 }
 
+// Returns the number of blocks in the subtree at root, or -1 if the subtree breaks
+// the size order, the AVL condition or holds blocks of another class
+int check_free_tree(char *root, int fl, int sl)
+{
+    if (root == NULL) return 0;
+
+    char *left = GET_LEFT(root), *right = GET_RIGHT(root);
+    long balance = GET_HEIGHT(left) - GET_HEIGHT(right);
+    int node_fl, node_sl;
+    MAPPING_INSERT(BLOCK_SIZE(root), &node_fl, &node_sl);
+
+    if (BLOCK_ALLOC(root) == 1 || BLOCK_SIZE(root) < TREE_MIN_SIZE || node_fl != fl || node_sl != sl) return -1;
+    if ((left != NULL && GET_PARENT(left) != root) || (right != NULL && GET_PARENT(right) != root)) return -1;
+    if ((left != NULL && !NODE_LESS(left, root)) || (right != NULL && !NODE_LESS(root, right))) return -1;
+    if (balance > 1 || balance < -1 || GET_HEIGHT(root) != 1 + (balance > 0 ? GET_HEIGHT(left) : GET_HEIGHT(right))) return -1;
+
+    int left_count = check_free_tree(left, fl, sl), right_count = check_free_tree(right, fl, sl);
+    if (left_count < 0 || right_count < 0) return -1;
+
+    return 1 + left_count + right_count;
+}
+
+// Returns the number of blocks in the mini lists, or -1 if a list disagrees with the bitmap
+// or holds a block that is allocated, not a mini block, in the wrong list or not coalesced
+int check_mini_lists()
+{
+    int count = 0;
+
+    for (int list = 0; list < MINI_LISTS; list++) {
+        if ((ctx->mini_lists[list] != NULL) != (((ctx->mini_bitmap >> list) & 1) == 1)) return -1;
+
+        for (char *addr = ctx->mini_lists[list]; addr != NULL; addr = GET_NEXT_MINI(addr)) {
+            if (BLOCK_ALLOC(addr) == 1 || BLOCK_SIZE(addr) != MINI_SIZE || MINI_LIST(addr) != list) return -1;
+            if (GET_PREV_ALLOC(HEADER(addr)) == 0 || BLOCK_ALLOC(NEXT_ADDR(addr)) == 0) return -1;
+            count += 1;
+        }
+    }
+    return count;
+}
+
+#ifdef MM_SIDE_TABLE
+// Returns whether the side table agrees with the block at given address: its entry holds the size
+// and allocation of its header, and the entry of its last granule those of its footer if it is free
+bool check_side_entry(char *addr)
+{
+    uint32_t *entry = SIDE_ENTRY(addr);
+    if (entry == NULL) return true;
+    if ((SIDE_SIZE(entry) != SIDE_SPILL && SIDE_SIZE(entry) != GET_SIZE(HEADER(addr))) || (*entry & 0x1) != GET_ALLOC(HEADER(addr))) return false;
+    if (GET_ALLOC(HEADER(addr)) || GET_SIZE(HEADER(addr)) <= MINI_SIZE) return true;
+    entry = SIDE_ENTRY(addr + GET_SIZE(HEADER(addr)) - ALIGNMENT);
+    return entry == NULL || SIDE_SIZE(entry) == SIDE_SPILL || SIDE_SIZE(entry) == GET_SIZE(FOOTER(addr));
+}
+#endif
+
+// Returns whether the block at given address is a valid slab page: its slot size is one of the
+// classes, the free slot count matches the bitmap, no bit is set past the last slot and at least
+// one slot is in use, since an empty page goes back to the heap
+bool check_slab_page(char *page)
+{
+    size_t slot_size = GET_SLOT_SIZE(page), free_slots = 0;
+
+    if (BLOCK_SIZE(page) != SLAB_BLOCK_SIZE || slot_size == 0 || slot_size > SLAB_CLASSES * ALIGNMENT || slot_size % ALIGNMENT != 0) return false;
+
+    size_t slots = SLAB_SLOTS(slot_size);
+    for (int word = 0; word < SLAB_BITMAP_WORDS; word++) {
+        uint64_t bits = GET(SLAB_BITMAP(page, word));
+        size_t valid = (slots > (size_t)word * 64) ? slots - word * 64 : 0;
+
+        if (valid < 64 && (bits >> valid) != 0) return false;
+        free_slots += __builtin_popcountll(bits);
+    }
+    return free_slots == GET_FREE_SLOTS(page) && free_slots < slots;
+}
+
 /*
  * mm_checkheap
  */
 bool mm_checkheap(int lineno) {
+    if (ctx->engine == ENGINE_BUDDY) return buddy_checkheap(lineno);
+
     #ifdef DEBUG
 
-        char *addr = heap_start;
-        int count = 0;
+        char *addr = ctx->heap_start;
+        int count = 0, slab_count = 0, run_count = 0;
+        size_t prev = PREV_BITS(0, 1);
 
         // Heap conditions, if any are true, print heap and corresponding error
-        while(GET_SIZE(HEADER(addr)) > 0){
+        while(BLOCK_SIZE(addr) > 0){
             if (!aligned(addr))  {
                 dbg_printf("\nERROR AT LINE %d: ", lineno);
-                dbg_printf("Address %lx is not aligned!\n", (uint64_t)addr - (uint64_t)mem_heap_lo());
+                dbg_printf("Address %lx is not aligned!\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
                 print_heap();
                 print_freelist();
                 return false;
             }
-            else if ((addr == free_list_lo || addr == free_list_hi) && GET_ALLOC(addr) == 1)  {
+#ifdef MM_SIDE_TABLE
+            else if (!check_side_entry(addr))  {
                 dbg_printf("\nERROR AT LINE %d: ", lineno);
-                dbg_printf("Address %lx's allocated bit is one but is part of the free list as well\n", (uint64_t)addr - (uint64_t)mem_heap_lo());
+                dbg_printf("Side table doesn't match the header or footer at address %lx\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
                 print_heap();
                 print_freelist();
                 return false;
             }
-            else if ((GET_SIZE(HEADER(addr)) != GET_SIZE(FOOTER(addr))) || (GET_ALLOC(HEADER(addr)) != GET_ALLOC(FOOTER(addr))))  {
+#endif
+            else if (!BLOCK_ALLOC(addr) && BLOCK_SIZE(addr) > MINI_SIZE && ((BLOCK_SIZE(addr) != GET_SIZE(FOOTER(addr))) || (BLOCK_ALLOC(addr) != GET_ALLOC(FOOTER(addr)))))  {
                 dbg_printf("\nERROR AT LINE %d: ", lineno);
-                dbg_printf("Header and footer don't match at address %lx\n", (uint64_t)addr - (uint64_t)mem_heap_lo());
+                dbg_printf("Header and footer don't match at address %lx\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
                 print_heap();
                 print_freelist();
                 return false;
             }
-            else if (free_list_lo == heap_start && GET_ALLOC(HEADER(addr)) == 0)  {
+            else if (GET_PREV(HEADER(addr)) != prev)  {
                 dbg_printf("\nERROR AT LINE %d: ", lineno);
-                dbg_printf("Free list doesn't exist but there is a free block at address %lx\n", (uint64_t)addr - (uint64_t)mem_heap_lo());
+                dbg_printf("Prev alloc or prev mini bit at address %lx doesn't match the previous block\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
                 print_heap();
                 print_freelist();
                 return false;
             }
-            /*else if (WRITE CONDITION HERE)  {
+            else if (ctx->fl_bitmap == 0 && BLOCK_ALLOC(addr) == 0 && addr != ctx->wilderness)  {
                 dbg_printf("\nERROR AT LINE %d: ", lineno);
-                dbg_printf("ERROR MESSAGE HERE!\n");
+                dbg_printf("Free list doesn't exist but there is a free block at address %lx\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
                 print_heap();
                 print_freelist();
                 return false;
-            }*/
-            if (GET_ALLOC(HEADER(addr)) == 0) count += 1;
-            addr = NEXT_ADDR(addr);
-        }
-
-        addr = free_list_lo;
-        int count_2 = 0;
-        do {            
-            if (GET_ALLOC(HEADER(addr)) == 1)  {
+            }
+            else if (BLOCK_ALLOC(addr) && GET_DECOMMITTED(HEADER(addr)))  {
+                dbg_printf("\nERROR AT LINE %d: ", lineno);
+                dbg_printf("Allocated block at address %lx is marked decommitted\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+                print_heap();
+                print_freelist();
+                return false;
+            }
+            else if (BLOCK_ALLOC(addr) && IS_SLAB(addr) && !check_slab_page(addr))  {
+                dbg_printf("\nERROR AT LINE %d: ", lineno);
+                dbg_printf("Slab page at address %lx has a bad slot size or its bitmap doesn't match its free slots\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+                print_heap();
+                print_freelist();
+                return false;
+            }
+            else if (IS_FREE_RUN(addr) && (!IS_RUN(addr) || GET_SIZE(FOOTER(addr)) != BLOCK_SIZE(addr) || IS_FREE_RUN(NEXT_ADDR(addr))))  {
                 dbg_printf("\nERROR AT LINE %d: ", lineno);
-                dbg_printf("Address %lx is part of the free list but also allocated\n", (uint64_t)addr - (uint64_t)mem_heap_lo());
+                dbg_printf("Free run at address %lx is not a run, has a bad size word or wasn't merged with the next one\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
                 print_heap();
                 print_freelist();
                 return false;
             }
-            else if ((GET_ALLOC(HEADER(PREV_ADDR(addr))) == 0 && GET_SIZE(HEADER(PREV_ADDR(addr))) > 0) || (GET_ALLOC(HEADER(NEXT_ADDR(addr))) == 0 && GET_SIZE(HEADER(NEXT_ADDR(addr))) > 0))  {
+            else if (IS_RUN(addr) && (!BLOCK_ALLOC(addr) || BLOCK_SIZE(addr) % RUN_PAGE_SIZE != 0))  {
                 dbg_printf("\nERROR AT LINE %d: ", lineno);
-                dbg_printf("Coalescing failed at address %lx\n", (uint64_t)addr - (uint64_t)mem_heap_lo());
+                dbg_printf("Run at address %lx is not an allocated block of whole pages\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
                 print_heap();
                 print_freelist();
                 return false;
@@ -604,16 +2803,193 @@ bool mm_checkheap(int lineno) {
                 print_freelist();
                 return false;
             }*/
-            count_2 += 1;
-        } while((addr = GET_NEXT_FREE(addr)) != free_list_lo);
+            if (BLOCK_ALLOC(addr) == 0) count += 1;
+            if (BLOCK_ALLOC(addr) && IS_SLAB(addr) && GET_FREE_SLOTS(addr) > 0) slab_count += 1;
+            if (IS_FREE_RUN(addr)) run_count += 1;
+            prev = PREV_BITS(BLOCK_SIZE(addr), BLOCK_ALLOC(addr));
+            addr = NEXT_ADDR(addr);
+        }
+
+        // The buffer header at the end must know about the last block as well
+        if (GET_PREV(HEADER(addr)) != prev)  {
+            dbg_printf("\nERROR AT LINE %d: ", lineno);
+            dbg_printf("Prev alloc or prev mini bit of the buffer header doesn't match the last block\n");
+            print_heap();
+            print_freelist();
+            return false;
+        }
+
+        // The free block at the end of the heap, and no other, must be the wilderness
+        char *wilderness = GET_PREV_ALLOC(HEADER(addr)) ? NULL : PREV_ADDR(addr);
+        if (ctx->wilderness != wilderness)  {
+            dbg_printf("\nERROR AT LINE %d: ", lineno);
+            dbg_printf("Wilderness at %p is not the free block at the end of the heap\n", (void *)ctx->wilderness);
+            print_heap();
+            print_freelist();
+            return false;
+        }
+
+        int count_2 = (wilderness != NULL);
+        for (int fl = 0; fl < FL_COUNT; fl++) {
+            for (int sl = 0; sl < SL_COUNT; sl++) {
+
+                // The bitmaps must agree with whether the list is empty
+                if ((ctx->free_lists[fl][sl] != NULL) != (((ctx->sl_bitmap[fl] >> sl) & 1) == 1) || (ctx->sl_bitmap[fl] != 0) != (((ctx->fl_bitmap >> fl) & 1) == 1))  {
+                    dbg_printf("\nERROR AT LINE %d: ", lineno);
+                    dbg_printf("Bitmaps don't match the free list of class %d,%d\n", fl, sl);
+                    print_heap();
+                    print_freelist();
+                    return false;
+                }
+
+                // Large classes must hold an ordered and balanced tree, its blocks count as entries
+                if (ctx->free_lists[fl][sl] != NULL && BLOCK_SIZE(ctx->free_lists[fl][sl]) >= TREE_MIN_SIZE) {
+                    int tree_count = check_free_tree(ctx->free_lists[fl][sl], fl, sl);
+                    if (tree_count < 0 || GET_PARENT(ctx->free_lists[fl][sl]) != NULL)  {
+                        dbg_printf("\nERROR AT LINE %d: ", lineno);
+                        dbg_printf("The best fit tree of class %d,%d is out of order, unbalanced or holds another class\n", fl, sl);
+                        print_heap();
+                        print_freelist();
+                        return false;
+                    }
+                    count_2 += tree_count;
+                    continue;
+                }
+
+                // The mini class must show the lowest non-empty mini list, whose entries are all checked
+                if (fl == 0 && sl == (int)(MINI_SIZE / ALIGNMENT)) {
+                    int mini_count = check_mini_lists();
+                    if (mini_count < 0 || ctx->free_lists[fl][sl] != ((ctx->mini_bitmap == 0) ? NULL : ctx->mini_lists[LSB(ctx->mini_bitmap)]))  {
+                        dbg_printf("\nERROR AT LINE %d: ", lineno);
+                        dbg_printf("The mini lists don't match their bitmap or hold a block that is not a free uncoalesced mini block\n");
+                        print_heap();
+                        print_freelist();
+                        return false;
+                    }
+                    count_2 += mini_count;
+                    continue;
+                }
+
+                for (addr = ctx->free_lists[fl][sl]; addr != NULL; addr = GET_NEXT_FREE(addr)) {
+                    int list_fl, list_sl;
+                    MAPPING_INSERT(BLOCK_SIZE(addr), &list_fl, &list_sl);
+
+                    if (BLOCK_ALLOC(addr) == 1)  {
+                        dbg_printf("\nERROR AT LINE %d: ", lineno);
+                        dbg_printf("Address %lx is part of the free list but also allocated\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+                        print_heap();
+                        print_freelist();
+                        return false;
+                    }
+                    else if (GET_PREV_ALLOC(HEADER(addr)) == 0 || (BLOCK_ALLOC(NEXT_ADDR(addr)) == 0 && BLOCK_SIZE(NEXT_ADDR(addr)) > 0))  {
+                        dbg_printf("\nERROR AT LINE %d: ", lineno);
+                        dbg_printf("Coalescing failed at address %lx\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+                        print_heap();
+                        print_freelist();
+                        return false;
+                    }
+                    else if (list_fl != fl || list_sl != sl)  {
+                        dbg_printf("\nERROR AT LINE %d: ", lineno);
+                        dbg_printf("Address %lx of size %lx is in the free list of class %d,%d\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap), BLOCK_SIZE(addr), fl, sl);
+                        print_heap();
+                        print_freelist();
+                        return false;
+                    }
+                    else if (GET_NEXT_FREE(addr) != NULL && GET_PREV_FREE(GET_NEXT_FREE(addr)) != addr)  {
+                        dbg_printf("\nERROR AT LINE %d: ", lineno);
+                        dbg_printf("The next entry of address %lx doesn't point back to it\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap));
+                        print_heap();
+                        print_freelist();
+                        return false;
+                    }
+                    count_2 += 1;
+                }
+            }
+        }
 
-        if (GET_PREV_FREE(addr) != free_list_hi)  {
+        // Every slab page with a free slot must be on the list of its class and nothing else
+        for (int class = 0; class < SLAB_CLASSES; class++) {
+            for (addr = ctx->slab_pages[class]; addr != NULL; addr = GET_NEXT_PAGE(addr)) {
+                if (!IS_SLAB(addr) || GET_SLOT_SIZE(addr) != (size_t)(class + 1) * ALIGNMENT || GET_FREE_SLOTS(addr) == 0 || (GET_NEXT_PAGE(addr) != NULL && GET_PREV_PAGE(GET_NEXT_PAGE(addr)) != addr))  {
+                    dbg_printf("\nERROR AT LINE %d: ", lineno);
+                    dbg_printf("Slab page at address %lx doesn't belong in the list of class %d\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap), class);
+                    print_heap();
+                    print_freelist();
+                    return false;
+                }
+                slab_count -= 1;
+            }
+        }
+        if (slab_count != 0)  {
+            dbg_printf("\nERROR AT LINE %d: ", lineno);
+            dbg_printf("Slab pages with free slots and the slab class lists differ by %d pages\n", slab_count);
+            print_heap();
+            print_freelist();
+            return false;
+        }
+
+        // Every free run must be on the list of its page count and nothing else
+        for (int class = 0; class < RUN_CLASSES; class++) {
+            if ((ctx->run_lists[class] != NULL) != (((ctx->run_bitmap >> class) & 1) == 1))  {
+                dbg_printf("\nERROR AT LINE %d: ", lineno);
+                dbg_printf("Bitmap doesn't match the free run list of class %d\n", class);
+                print_heap();
+                print_freelist();
+                return false;
+            }
+            for (addr = ctx->run_lists[class]; addr != NULL; addr = GET_NEXT_FREE(addr)) {
+                if (!IS_FREE_RUN(addr) || RUN_CLASS(BLOCK_SIZE(addr)) != class || (GET_NEXT_FREE(addr) != NULL && GET_PREV_FREE(GET_NEXT_FREE(addr)) != addr))  {
+                    dbg_printf("\nERROR AT LINE %d: ", lineno);
+                    dbg_printf("Run at address %lx doesn't belong in the free run list of class %d\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap), class);
+                    print_heap();
+                    print_freelist();
+                    return false;
+                }
+                run_count -= 1;
+            }
+        }
+        if (run_count != 0)  {
+            dbg_printf("\nERROR AT LINE %d: ", lineno);
+            dbg_printf("Free runs and the free run lists differ by %d runs\n", run_count);
+            print_heap();
+            print_freelist();
+            return false;
+        }
+
+        // Every parked block must be an allocated block of the size of its list in the heap
+        size_t quick_bytes = 0;
+        for (int list = 0; list < QUICK_LISTS; list++) {
+            for (addr = ctx->quick_lists[list]; addr != NULL; addr = (char *)GET(addr)) {
+                if (!mem_in_heap_h(ctx->heap, addr) || !BLOCK_ALLOC(addr) || BLOCK_SIZE(addr) != (size_t)(list + 1) * ALIGNMENT)  {
+                    dbg_printf("\nERROR AT LINE %d: ", lineno);
+                    dbg_printf("Block at address %lx doesn't belong in quick list %d\n", (uint64_t)addr - (uint64_t)mem_heap_lo_h(ctx->heap), list);
+                    print_heap();
+                    print_freelist();
+                    return false;
+                }
+                quick_bytes += BLOCK_SIZE(addr);
+            }
+        }
+        if (quick_bytes != ctx->quick_bytes)  {
             dbg_printf("\nERROR AT LINE %d: ", lineno);
-            dbg_printf("The free list's local pointer for the free_list_hi variable points to an incorrect value\n");
+            dbg_printf("Quick lists hold %lx bytes while %lx are counted\n", (uint64_t)quick_bytes, (uint64_t)ctx->quick_bytes);
             print_heap();
             print_freelist();
             return false;
-        } else if (count != count_2)  {
+        }
+
+        // Every large object must be a registered region that holds its requested size
+        for (addr = ctx->large_objects; addr != NULL; addr = GET_NEXT_LARGE(addr)) {
+            if (!IS_LARGE(addr) || !BLOCK_ALLOC(addr) || GET_LARGE_SIZE(addr) != LARGE_REGION_SIZE(GET_LARGE_REQUEST(addr)) || !mem_in_region_h(ctx->heap, addr - LARGE_HEADER_SIZE, GET_LARGE_SIZE(addr)) || (GET_NEXT_LARGE(addr) != NULL && GET_PREV_LARGE(GET_NEXT_LARGE(addr)) != addr))  {
+                dbg_printf("\nERROR AT LINE %d: ", lineno);
+                dbg_printf("Large object at %p is not a mapped region that holds its request\n", (void *)addr);
+                print_heap();
+                print_freelist();
+                return false;
+            }
+        }
+
+        if (count != count_2)  {
             dbg_printf("\nERROR AT LINE %d: ", lineno);
             dbg_printf("Free list has %d entries while there are %d free blocks\n", count_2, count);
             print_heap();
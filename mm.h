@@ -21,5 +21,52 @@ extern void *calloc (size_t nmemb, size_t size);
 
 extern bool mm_init(void);
 
+/* Gives the free space at the end of the heap back, all but pad bytes of it */
+extern bool mm_trim(size_t pad);
+
+/* Picks the allocator engine used from the next mm_init on, freelist or buddy */
+extern bool mm_set_engine(const char *name);
+
+/* Hands frees to a background thread, in the thread safe build only */
+extern bool mm_set_background_free(bool on);
+
+/* Forces count arenas that threads take in turn, in the thread safe build only, 0 for one per CPU */
+extern bool mm_set_arenas(int count);
+
+/* Sets the request size from which large objects get a region of their own, 1 MB by default */
+extern bool mm_set_large_threshold(size_t size);
+
+/*
+ * What the heap growth policy of the default context decided since mm_init:
+ * how many times the heap grew, by how many bytes, how many of those it was
+ * actually short of, and the largest chunk it reached
+ */
+typedef struct mm_growth_stats {
+    long grows;
+    size_t grown;
+    size_t needed;
+    size_t max_chunk;
+} mm_growth_stats_t;
+
+extern void mm_growth_stats(mm_growth_stats_t *stats);
+
 /* This is for debugging.  Returns false if error encountered */
 extern bool mm_checkheap(int lineno);
+
+/*
+ * Allocator contexts, each with a heap instance of memlib of its own. The
+ * functions above work on the default context and heap, the mm_ctx_ ones
+ * on the given context. Threads may work on separate contexts at once, but
+ * without THREADS=1 only one thread at a time may work on any one context
+ */
+typedef struct mm_context mm_context_t;
+struct mem_heap;
+
+extern mm_context_t *mm_context_create(struct mem_heap *heap);
+extern void mm_context_destroy(mm_context_t *context);
+extern bool mm_ctx_init(mm_context_t *context);
+extern void *mm_ctx_malloc(mm_context_t *context, size_t size);
+extern void mm_ctx_free(mm_context_t *context, void *ptr);
+extern void *mm_ctx_realloc(mm_context_t *context, void *ptr, size_t size);
+extern void *mm_ctx_calloc(mm_context_t *context, size_t nmemb, size_t size);
+extern bool mm_ctx_checkheap(mm_context_t *context, int lineno);